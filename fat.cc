@@ -1,24 +1,37 @@
 #include "fat_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
 #include <iostream>
 #include <sstream>
 #include <algorithm>
 
-bool str_equals(const std::string& a, const std::string& b)
-{
-    return std::equal(a.begin(), a.end(),
-                      b.begin(), b.end(),
-                      [](char a, char b) {
-                          return tolower(a) == tolower(b);
-                      });
+FatVolume *mounted_volume;
+MemoryBudget memory_budget;
+
+std::atomic<int> trace_level(FAT_TRACE_OFF);
+std::mutex trace_mutex;
+FatTraceSink trace_sink;
+
+void fat_set_trace_level(FatTraceLevel level) {
+    trace_level.store(level, std::memory_order_relaxed);
 }
 
-bool isSpaceOrDot(unsigned char c){
-    return (c == ' ' || c == '\n' || c == '\r' ||
-        c == '\t' || c == '\v' || c == '\f' || c == '.');
+void fat_set_trace_sink(FatTraceSink sink) {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    trace_sink = sink;
 }
 
-void string_to_dir_name_format(std::string &s) {
-    s.erase(remove_if(s.begin(), s.end(), isSpaceOrDot), s.end());
+void trace_emit(FatTraceLevel level, const std::string &message) {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    if(trace_sink){
+        trace_sink(level, message);
+    } else {
+        std::cerr << "fat: " << message << "\n";
+    }
 }
 
 // removes whitespace from a string
@@ -31,15 +44,36 @@ std::vector<std::string> &split_path(const std::string &path, std::vector<std::s
     std::stringstream ss(path.substr(1)); // ignore the first val as it should be a '/'
     std::string item;
     while(std::getline(ss, item, '/')) {
-        if(item != "." && item !=".."){
-            string_to_dir_name_format(item);
-        }
         elems.push_back(item);
     }
     return elems;
 }
 
-uint32_t get_dir_cluster_num(DirEntry &dir){
+// Encodes a path component as the DIR_Name it would be stored under, ignoring whitespace
+// and case. Returns false if it has no 8.3 form, so can't name any entry.
+bool encode_short_name(std::string name, ShortName &short_name) {
+    short_name.fill(' ');
+    if(name == "." || name == ".."){
+        std::copy(name.begin(), name.end(), short_name.begin());
+        return true;
+    }
+    remove_space(name);
+    size_t dot = name.rfind('.');
+    size_t base_len = dot == std::string::npos ? name.size() : dot;
+    size_t ext_len = dot == std::string::npos ? 0 : name.size() - dot - 1;
+    if(base_len == 0 || base_len > 8 || ext_len > 3 || name.find('.') != dot){
+        return false;
+    }
+    for(size_t i = 0; i < base_len; i++){
+        short_name[i] = toupper((unsigned char) name[i]);
+    }
+    for(size_t i = 0; i < ext_len; i++){
+        short_name[8 + i] = toupper((unsigned char) name[dot + 1 + i]);
+    }
+    return true;
+}
+
+uint32_t get_dir_cluster_num(const DirEntry &dir){
     uint32_t combine = ((unsigned int) dir.DIR_FstClusHI << 16) + ((unsigned int) dir.DIR_FstClusLO);
     return combine;
 }
@@ -52,276 +86,1245 @@ bool is_root_ref(const std::string &path){
     return true;
 }
 
-bool dir_matches_name(DirEntry &dir, std::string expected_name){
-    std::string name(&dir.DIR_Name[0], &dir.DIR_Name[11]);
-    remove_space(name);
-    if(str_equals(expected_name, name)) return true;
+bool MemoryBudget::charge(size_t bytes) {
+    size_t cur = used.load();
+    do {
+        if(bytes > limit.load() || cur > limit.load() - bytes){
+            return false;
+        }
+    } while(!used.compare_exchange_weak(cur, cur + bytes));
+    return true;
+}
 
-    return false;
+void MemoryBudget::release(size_t bytes) {
+    used.fetch_sub(bytes);
 }
-std::string dir_name_as_string(DirEntry &dir) {
-    std::string name(&dir.DIR_Name[0], &dir.DIR_Name[11]);
-    remove_space(name);
-    return name;
+
+void fat_set_memory_budget(size_t bytes) {
+    memory_budget.limit.store(bytes);
 }
 
-std::vector<int> get_clusters_from_fat(int cluster_num) {
-    std::vector<int> cluster_nums;
-    while (cluster_num < 0x0FFFFFF8){
-        cluster_nums.push_back(cluster_num);
-        cluster_num = fatTable[cluster_num] & 0x0FFFFFFF;
+size_t fat_memory_in_use() {
+    return memory_budget.used.load();
+}
+
+FatVolume::~FatVolume() {
+    // wait for readahead still reading from the image
+    fds.clear();
+    async.wait_idle();
+    io.reset();
+    if(image_fd >= 0){
+        close(image_fd);
     }
-    return cluster_nums;
 }
 
-int get_open_fdtable_index() {
-    int i = 0;
-    for (FDEntry e : fdTable) {
-        if(e.isEmpty){
-            return i;
+// byte offset of the first sector of a cluster within the image
+uint64_t cluster_offset(const FatVolume &vol, uint32_t cluster) {
+    uint64_t first_sector_of_cluster = ((uint64_t)(cluster - 2) * vol.bpb.BPB_SecPerClus) + vol.first_data_sector;
+    return first_sector_of_cluster * vol.bpb.BPB_BytsPerSec;
+}
+
+// copies count bytes starting at offset in the image into dest
+bool read_image(const FatVolume &vol, char *dest, uint64_t offset, uint64_t count) {
+    if(vol.image_map != nullptr){
+        if(offset > vol.image_size || count > vol.image_size - offset){
+            return false;
+        }
+        memcpy(dest, vol.image_map + offset, count);
+        return true;
+    }
+    while(count > 0){
+        ssize_t n = pread(vol.image_fd, dest, count, offset);
+        if(n < 0 && errno == EINTR){
+            continue;
         }
-        i++;
+        if(n <= 0){
+            // an I/O error, or the read ran past the end of the image
+            return false;
+        }
+        dest += n;
+        offset += n;
+        count -= n;
     }
-    return -1;
+    return true;
 }
 
-std::vector<DirEntry> read_cluster(int cluster_num) {
-    std::vector<int> cluster_nums = get_clusters_from_fat(cluster_num);
-    std::vector<DirEntry> dirEntries;
-    char *cur_cluster = (char *)malloc(cluster_size * sizeof(char));
-    for(int cluster : cluster_nums){
-        uint32_t first_sector_of_cluster = ((cluster - 2) * fatbpb->BPB_SecPerClus) + first_data_sector;
-        infile.seekg(first_sector_of_cluster * fatbpb->BPB_BytsPerSec);
-        infile.read(cur_cluster, cluster_size);
-        uint32_t cur_entry = 0;
-        while(cur_entry * dir_entry_size < cluster_size){
-            // get the first byte of the entry
-            char firstByte = cur_cluster[cur_entry * dir_entry_size];
-            if(firstByte == 0x0){
+// Upper bound on how many bytes of a directory are read from the image in one call
+const uint32_t max_dir_read_size = 256 * 1024;
+
+// Returns a pointer to length bytes at offset in the image mapping, or nullptr if they are
+// not all inside it
+const char *mapped_data(const FatVolume &vol, uint64_t offset, uint64_t length) {
+    if(vol.image_map == nullptr || offset > vol.image_size || length > vol.image_size - offset){
+        return nullptr;
+    }
+    return vol.image_map + offset;
+}
+
+// Walks the cluster chain starting at cluster_num, merging physically adjacent clusters
+// into extents.
+std::vector<Extent> get_extents_from_fat(const FatVolume &vol, uint32_t cluster_num) {
+    std::vector<Extent> extents;
+    uint32_t file_cluster = 0;
+    FatTable::Page page;
+    uint32_t page_no = 0;
+    while(cluster_num >= 2 && cluster_num < vol.count_of_clusters + 2 && file_cluster < vol.count_of_clusters){
+        if(!extents.empty() && extents.back().start + extents.back().length == cluster_num){
+            extents.back().length++;
+        } else {
+            extents.push_back({file_cluster, cluster_num, 1});
+        }
+        file_cluster++;
+        bool page_loaded = true;
+        for(;;){
+            // only go back to the FAT cache when the chain leaves the current page
+            if(!page || cluster_num / fat_page_entries != page_no){
+                page_no = cluster_num / fat_page_entries;
+                page = vol.fat.page(vol, page_no);
+                if(!page){
+                    page_loaded = false;
+                    break;
+                }
+            }
+            // take a run of clusters that each link to the next in one go, without passing
+            // the end of the page or the limits of the loop above
+            uint32_t index = cluster_num % fat_page_entries;
+            uint32_t limit = std::min({fat_page_entries - index, vol.count_of_clusters + 1 - cluster_num,
+                                       vol.count_of_clusters - file_cluster});
+            uint32_t run = fat_run_length(page.get() + index, cluster_num, limit);
+            extents.back().length += run;
+            file_cluster += run;
+            cluster_num += run;
+            if(run == 0 || run < limit){
                 break;
             }
-            if(firstByte != 0xE5){
-                DirEntry *newDirEntry = (DirEntry *)&(cur_cluster[cur_entry * dir_entry_size]);
-                dirEntries.push_back(*newDirEntry);
+        }
+        if(!page_loaded){
+            break;
+        }
+        cluster_num = page.get()[cluster_num % fat_page_entries] & 0x0FFFFFFF;
+    }
+    return extents;
+}
+
+// Returns the extent holding the file_cluster'th cluster of a file, or extents.end()
+std::vector<Extent>::const_iterator find_extent(const std::vector<Extent> &extents, uint32_t file_cluster) {
+    auto it = std::upper_bound(extents.begin(), extents.end(), file_cluster,
+                               [](uint32_t c, const Extent &e) { return c < e.file_cluster; });
+    if(it == extents.begin()){
+        return extents.end();
+    }
+    --it;
+    if(file_cluster - it->file_cluster >= it->length){
+        return extents.end();
+    }
+    return it;
+}
+
+// Calls visit(data) with the contents of each cluster of the directory starting at
+// cluster_num, in chain order, until visit returns false. Physically contiguous clusters are
+// fetched together, through the block cache unless the image is mapped.
+template <typename Visit>
+bool visit_dir_clusters(const FatVolume &vol, uint32_t cluster_num, Visit visit) {
+    uint32_t clusters_per_read = std::max<uint32_t>(1, max_dir_read_size / vol.cluster_size);
+    std::vector<BlockCache::Block> blocks;
+    for(const Extent &extent : get_extents_from_fat(vol, cluster_num)){
+        for(uint32_t run_index = 0; run_index < extent.length; run_index += clusters_per_read){
+            uint32_t run_count = std::min(clusters_per_read, extent.length - run_index);
+            uint32_t run_start = extent.start + run_index;
+            if(vol.image_map != nullptr){
+                const char *run = mapped_data(vol, cluster_offset(vol, run_start), (uint64_t) run_count * vol.cluster_size);
+                if(run == nullptr){
+                    return false;
+                }
+                for(uint32_t i = 0; i < run_count; i++){
+                    if(!visit(run + (uint64_t) i * vol.cluster_size)){
+                        return true;
+                    }
+                }
+            } else {
+                if(!vol.blocks.fetch(vol, run_start, run_count, blocks)){
+                    return false;
+                }
+                for(const BlockCache::Block &block : blocks){
+                    if(!visit(block.get())){
+                        return true;
+                    }
+                }
             }
-            ++cur_entry;
         }
     }
-    free(cur_cluster);
-    return dirEntries;
+    return true;
 }
 
-bool get_dir_entry(uint32_t cluster_num, std::string dir_name, DirEntry &dir){
-    std::vector<int> cluster_nums = get_clusters_from_fat(cluster_num);
-    char *cur_cluster = (char *)malloc(cluster_size * sizeof(char));
-    for(int cluster : cluster_nums){
-        uint32_t first_sector_of_cluster = ((cluster - 2) * fatbpb->BPB_SecPerClus) + first_data_sector;
-        infile.seekg(first_sector_of_cluster * fatbpb->BPB_BytsPerSec);
-        infile.read(cur_cluster, cluster_size);
-        uint32_t cur_entry = 0;
-        while(cur_entry * dir_entry_size < cluster_size){
-            // get the first byte of the entry
-            char firstByte = cur_cluster[cur_entry * dir_entry_size];
-            if(firstByte == 0x0){
+// Calls visit(entries, count, masks) for groups of at most 64 entries of the directory
+// starting at cluster_num, as classified by scan_dir_entries(), until visit returns false.
+// Each cluster ends at its first free entry, which is left out of count and masks.
+template <typename Visit>
+bool visit_dir_entries(const FatVolume &vol, uint32_t cluster_num, Visit visit) {
+    uint32_t entries_per_cluster = vol.cluster_size / vol.dir_entry_size;
+    return visit_dir_clusters(vol, cluster_num, [&](const char *cur_cluster) {
+        for(uint32_t first = 0; first < entries_per_cluster; first += 64){
+            const char *entries = cur_cluster + first * vol.dir_entry_size;
+            uint32_t count = std::min<uint32_t>(64, entries_per_cluster - first);
+            DirEntryMasks masks;
+            scan_dir_entries(entries, count, masks);
+            bool end_of_cluster = masks.free != 0;
+            if(end_of_cluster){
+                count = __builtin_ctzll(masks.free);
+                uint64_t before_free = (1ULL << count) - 1;
+                masks.free = 0;
+                masks.deleted &= before_free;
+                masks.long_name &= before_free;
+                masks.volume_label &= before_free;
+                masks.live &= before_free;
+            }
+            if(!visit(entries, count, masks)){
+                return false;
+            }
+            if(end_of_cluster){
                 break;
             }
-            if(firstByte != 0xE5){
-                DirEntry *newDirEntry = (DirEntry *)&(cur_cluster[cur_entry * dir_entry_size]);
-                if(dir_matches_name(*newDirEntry, dir_name)){
-                    dir = *newDirEntry;
-                    free(cur_cluster);
-                    return true;
-                }
+        }
+        return true;
+    });
+}
+
+bool visit_live_entries(const FatVolume &vol, uint32_t cluster, const std::function<void(const DirEntry &)> &visit) {
+    return visit_dir_entries(vol, cluster, [&](const char *entries, uint32_t count, const DirEntryMasks &masks) {
+        for(uint64_t live = masks.live; live != 0; live &= live - 1){
+            visit(((const DirEntry *) entries)[__builtin_ctzll(live)]);
+        }
+        return true;
+    });
+}
+
+// The key of an entry in a DirIndex: its DIR_Name in upper case
+ShortName dir_index_key(const DirEntry &dir) {
+    ShortName name;
+    for(int i = 0; i < 11; i++){
+        name[i] = toupper((unsigned char) dir.DIR_Name[i]);
+    }
+    return name;
+}
+
+// Reads the whole directory starting at cluster_num into a name index, keeping the first
+// entry with each name. Returns nullptr if the directory could not be read.
+DirIndexCache::Value build_dir_index(const FatVolume &vol, uint32_t cluster_num) {
+    std::shared_ptr<DirIndex> index = std::make_shared<DirIndex>();
+    bool read_ok = visit_dir_entries(vol, cluster_num, [&](const char *entries, uint32_t count, const DirEntryMasks &masks) {
+        for(uint64_t live = masks.live; live != 0; live &= live - 1){
+            const DirEntry *newDirEntry = (const DirEntry *) entries + __builtin_ctzll(live);
+            index->entries.emplace(dir_index_key(*newDirEntry), *newDirEntry);
+        }
+        return true;
+    });
+    if(!read_ok){
+        return nullptr;
+    }
+    FAT_TRACE(FAT_TRACE_DEBUG, "indexed directory at cluster " << cluster_num << ", "
+              << index->entries.size() << " entries");
+    return index;
+}
+
+// Scans the directory starting at cluster_num for dir_name without indexing it, stopping at
+// the first match. Returns false if it could not be read.
+bool find_dir_entry(const FatVolume &vol, uint32_t cluster_num, const ShortName &dir_name, DirEntry &dir, bool &found) {
+    found = false;
+    return visit_dir_entries(vol, cluster_num, [&](const char *entries, uint32_t count, const DirEntryMasks &masks) {
+        uint64_t matches = match_dir_entries(entries, count, dir_name) & masks.live;
+        if(matches == 0){
+            return true;
+        }
+        dir = ((const DirEntry *) entries)[__builtin_ctzll(matches)];
+        found = true;
+        return false;
+    });
+}
+
+// Looks dir_name up in the directory starting at cluster_num, through the directory's name
+// index. If read_failed is given, it is set when the directory could not be read, as
+// opposed to not holding dir_name.
+bool get_dir_entry(const FatVolume &vol, uint32_t cluster_num, const ShortName &dir_name, DirEntry &dir,
+                   bool *read_failed = nullptr){
+    if(!vol.dir_indexes.enabled()){
+        // an index that can't be kept would cost a full scan every time
+        bool found = false;
+        bool read_ok = find_dir_entry(vol, cluster_num, dir_name, dir, found);
+        if(read_failed != nullptr){
+            *read_failed = !read_ok;
+        }
+        return found;
+    }
+    DirIndexCache::Value index = vol.dir_indexes.find(cluster_num);
+    if(!index){
+        index = build_dir_index(vol, cluster_num);
+        if(!index){
+            if(read_failed != nullptr){
+                *read_failed = true;
             }
-            ++cur_entry;
+            return false;
         }
+        vol.dir_indexes.insert(cluster_num, index);
+    }
+    if(read_failed != nullptr){
+        *read_failed = false;
     }
-    free(cur_cluster);
-    return false;
+    auto it = index->entries.find(dir_name);
+    if(it == index->entries.end()){
+        return false;
+    }
+    dir = it->second;
+    return true;
 }
 
-bool fat_mount(const std::string &path) {
-    // Load the BPB
-    infile.open(path, std::ifstream::in | std::ifstream::binary);
-    if(infile.bad()){
+// Opens the image for pread(), or maps all of it when mode is FAT_MOUNT_MMAP
+bool open_image(FatVolume &vol, const std::string &path, FatMountMode mode) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        return false;
+    }
+    if(mode != FAT_MOUNT_MMAP){
+        vol.image_fd = fd;
+        return true;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(Fat32BPB)){
+        close(fd);
+        return false;
+    }
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);  // the mapping keeps its own reference to the file
+    if(map == MAP_FAILED){
+        return false;
+    }
+    size_t size = st.st_size;
+    vol.image_mapping.reset((const char *) map, [size](const char *p) { munmap((void *) p, size); });
+    vol.image_map = vol.image_mapping.get();
+    vol.image_size = size;
+    return true;
+}
+
+bool load_volume(FatVolume &vol, const std::string &path, FatMountMode mode) {
+    if(!open_image(vol, path, mode)){
         // the file could not be opened
         return false;
     }
-    int bpb_size = int(sizeof(Fat32BPB));
-    char *in_bpb = (char *)malloc(bpb_size);
-    if (!infile.read(in_bpb, bpb_size)){
-        infile.clear();
-        infile.close();
-        free(in_bpb);
+    // Load the BPB
+    if(!read_image(vol, (char *) &vol.bpb, 0, sizeof(Fat32BPB))){
         return false;
     }
-    fatbpb = (Fat32BPB *) in_bpb;
-    // set data for the file
-    root_dir_sectors = ((fatbpb->BPB_rootEntCnt * 32) + (fatbpb->BPB_BytsPerSec - 1)) / fatbpb->BPB_BytsPerSec;
-    first_data_sector = fatbpb->BPB_RsvdSecCnt + (fatbpb->BPB_NumFATs * fatbpb->BPB_FATSz32) + root_dir_sectors;
-    first_fat_sector = fatbpb->BPB_RsvdSecCnt;
-    data_sec = fatbpb->BPB_TotSec32 - (fatbpb->BPB_RsvdSecCnt +(fatbpb->BPB_NumFATs * fatbpb->BPB_FATSz32) + root_dir_sectors);
-    cluster_size = fatbpb->BPB_SecPerClus * fatbpb->BPB_BytsPerSec;
-    count_of_clusters = data_sec / fatbpb->BPB_SecPerClus;
-    root_cluster_32 = fatbpb->BPB_RootClus;
-    dir_entry_size = 32;//cluster_size / sizeof(DirEntry);
-
-    int bytes_per_fat = fatbpb->BPB_BytsPerSec * fatbpb->BPB_FATSz32;
-    // go to location of the fat table
-    infile.seekg(fatbpb->BPB_RsvdSecCnt * fatbpb->BPB_BytsPerSec);
-    fatTable = (uint32_t *)malloc(bytes_per_fat);
-    if(!infile.read((char *)fatTable, bytes_per_fat)){
-        std::cerr << "could not read fat\n";
-        free(fatTable);
-        free(in_bpb);
+    const Fat32BPB *fatbpb = &vol.bpb;
+    if(fatbpb->BPB_BytsPerSec == 0 || fatbpb->BPB_SecPerClus == 0){
+        FAT_TRACE(FAT_TRACE_ERROR, path << " does not have a FAT32 boot sector");
         return false;
     }
+    // set data for the file
+    vol.root_dir_sectors = ((fatbpb->BPB_rootEntCnt * 32) + (fatbpb->BPB_BytsPerSec - 1)) / fatbpb->BPB_BytsPerSec;
+    vol.first_data_sector = fatbpb->BPB_RsvdSecCnt + (fatbpb->BPB_NumFATs * fatbpb->BPB_FATSz32) + vol.root_dir_sectors;
+    vol.first_fat_sector = fatbpb->BPB_RsvdSecCnt;
+    vol.data_sec = fatbpb->BPB_TotSec32 - (fatbpb->BPB_RsvdSecCnt +(fatbpb->BPB_NumFATs * fatbpb->BPB_FATSz32) + vol.root_dir_sectors);
+    vol.cluster_size = fatbpb->BPB_SecPerClus * fatbpb->BPB_BytsPerSec;
+    vol.count_of_clusters = vol.data_sec / fatbpb->BPB_SecPerClus;
+    vol.root_cluster_32 = fatbpb->BPB_RootClus;
+
+    uint32_t bytes_per_fat = fatbpb->BPB_BytsPerSec * fatbpb->BPB_FATSz32;
+    // never index past the end of the FAT, even if the BPB claims more clusters than it holds
+    vol.count_of_clusters = std::min<uint32_t>(vol.count_of_clusters, bytes_per_fat / 4 - 2);
+    // the FAT itself is read a page at a time as chains are walked
+    vol.fat.offset = (uint64_t) fatbpb->BPB_RsvdSecCnt * fatbpb->BPB_BytsPerSec;
+    vol.fat.size = bytes_per_fat;
+    vol.fat.pages.value_bytes = fat_page_entries * 4;
+    vol.fat.pages.capacity = fat_cache_size.load();
+    vol.blocks.configure(vol.cluster_size, block_cache_size.load());
+    vol.dentries.configure(dentry_cache_size.load());
+    vol.dir_indexes.configure(dir_index_cache_size.load());
+    vol.readahead_size = (uint32_t) std::min<size_t>(readahead_size.load(), UINT32_MAX);
+    if(vol.image_map == nullptr){
+        vol.io = make_io_engine((FatIoEngine) io_engine.load(), vol.image_fd);
+    }
+    if(vol.image_map != nullptr){
+        // the FAT is used straight out of the mapping
+        if(vol.fat.offset + bytes_per_fat > vol.image_size){
+            FAT_TRACE(FAT_TRACE_ERROR, "could not read fat");
+            return false;
+        }
+        vol.fat.map = vol.image_map + vol.fat.offset;
+    }
     return true;
 }
 
-int fat_open(const std::string &path) {
-    if(!infile.is_open()){  // check if a file is mounted
-        std::cerr << "no file has been mounted \n";
-        return -1;
+FatVolume *fat_volume_mount(const std::string &path, FatMountMode mode) {
+    std::unique_ptr<FatVolume> vol(new FatVolume());
+    if(!load_volume(*vol, path, mode)){
+        return nullptr;
+    }
+    return vol.release();
+}
+
+void fat_volume_unmount(FatVolume *vol) {
+    delete vol;
+}
+
+bool fat_mount(const std::string &path, FatMountMode mode) {
+    // whatever was mounted before stays unmounted, even if this mount fails
+    fat_volume_unmount(mounted_volume);
+    mounted_volume = fat_volume_mount(path, mode);
+    return mounted_volume != nullptr;
+}
+
+FatVolume *fat_mounted_volume() {
+    return mounted_volume;
+}
+
+// Follows path from the root directory. Returns false if a component is missing.
+// Each prefix of the path is cached in vol.dentries, so a repeated lookup is one hash
+// lookup and a new file in a known directory only scans that directory.
+bool resolve_path(const FatVolume &vol, const std::string &path, DirEntry &entry, uint32_t &cluster) {
+    std::vector<std::string> path_dirs;
+    split_path(path, path_dirs);
+    std::vector<ShortName> names(path_dirs.size());
+    std::vector<std::string> keys;
+    std::string key;
+    for(size_t i = 0; i < path_dirs.size(); i++){
+        if(!encode_short_name(path_dirs[i], names[i])){
+            FAT_TRACE(FAT_TRACE_INFO, "could not find " << path << ", " << path_dirs[i] << " is not an 8.3 name");
+            return false;
+        }
+        key += '/';
+        key.append(names[i].begin(), names[i].end());
+        keys.push_back(key);
+    }
+
+    // the whole path is usually cached, so try that before walking its prefixes
+    int first = 0;
+    uint32_t cur_folder_cluster = vol.root_cluster_32;
+    if(!keys.empty()){
+        DentryCache::Value dentry = vol.dentries.find(keys.back());
+        if(dentry){
+            if(!dentry->found){
+                FAT_TRACE(FAT_TRACE_INFO, "could not find " << path << " (cached)");
+                return false;
+            }
+            entry = dentry->entry;
+            first = (int) path_dirs.size();
+            cur_folder_cluster = get_dir_cluster_num(entry);
+        }
     }
+    for(int i = first; i < (int)path_dirs.size(); i++){
+        if(cur_folder_cluster == 0) cur_folder_cluster = vol.root_cluster_32;
+
+        const std::string &dir_name = path_dirs.at(i);
+        DentryCache::Value dentry;
+        if(i + 1 < (int) path_dirs.size()){
+            dentry = vol.dentries.find(keys.at(i));
+        }
+        if(!dentry){
+            std::shared_ptr<Dentry> lookup = std::make_shared<Dentry>();
+            bool read_failed = false;
+            lookup->found = get_dir_entry(vol, cur_folder_cluster, names.at(i), lookup->entry, &read_failed);
+            if(read_failed){
+                // don't remember a lookup that failed because of an I/O error
+                FAT_TRACE(FAT_TRACE_ERROR, "could not read directory while looking up " << dir_name);
+                return false;
+            }
+            vol.dentries.insert(keys.at(i), lookup);
+            dentry = lookup;
+        }
+        if(!dentry->found){
+            FAT_TRACE(FAT_TRACE_INFO, "could not find directory with name " << dir_name);
+            return false;
+        }
+        entry = dentry->entry;
+        cur_folder_cluster = get_dir_cluster_num(entry);
+    }
+    if(cur_folder_cluster == 0) cur_folder_cluster = vol.root_cluster_32;
+    cluster = cur_folder_cluster;
+    return true;
+}
+
+// Adds dir to the fd table and returns its descriptor
+int add_open_file(FatVolume &vol, const DirEntry &dir) {
+    std::shared_ptr<Readahead> readahead;
+    if(vol.readahead_size != 0 && vol.image_map == nullptr){
+        readahead = std::make_shared<Readahead>();
+    }
+    int fd = vol.fds.open(dir, std::move(readahead));
+    if(fd == -1){
+        FAT_TRACE(FAT_TRACE_WARN, "out of space on the file descriptor table. Close a file before you open a new one");
+    }
+    return fd;
+}
+
+int open_file(FatVolume &vol, const std::string &path) {
     if(!is_root_ref(path)){
-        std::cerr << "trying to read a path that is not indexed from the root\n";
+        FAT_TRACE(FAT_TRACE_WARN, "trying to read a path that is not indexed from the root: " << path);
         return -1;
     }
-    int fdIndex = get_open_fdtable_index();
-    if(fdIndex == -1){
-        std::cerr << "out of space on the file descriptor table. Close a file before you open a new one";
+    DirEntry next_dir;
+    uint32_t cluster;
+    if(!resolve_path(vol, path, next_dir, cluster)){
         return -1;
     }
-    std::vector<std::string> path_dirs;
-    split_path(path, path_dirs);
+    // check to see if the next_dir val is a directory; this includes the root itself,
+    // for which resolve_path() never fills in next_dir
+    if(path.find_first_not_of('/') == std::string::npos ||
+            ((next_dir.DIR_Attr & DirEntryAttributes::DIRECTORY) == DirEntryAttributes::DIRECTORY)){
+        FAT_TRACE(FAT_TRACE_INFO, "file " << path << " is a directory");
+        return -1;
+    }
+    return add_open_file(vol, next_dir);
+}
 
-    uint32_t cur_folder_cluster = root_cluster_32;
-    DirEntry next_dir;
-    for(int i = 0; i < (int)path_dirs.size(); i++){
-        if(cur_folder_cluster == 0) cur_folder_cluster = root_cluster_32;
-        
-        std::string dir_name = path_dirs.at(i);        
-        bool found_folder = get_dir_entry(cur_folder_cluster, dir_name, next_dir);
-        if(!found_folder){
-            std::cerr << "could not find directory with name " << dir_name << "\n";
-            return -1;
-        }
-        cur_folder_cluster = get_dir_cluster_num(next_dir);
+// Opens the file described by dir, an entry the caller already has, e.g. from fat_readdir()
+int open_entry(FatVolume &vol, const DirEntry &dir) {
+    if((dir.DIR_Attr & DirEntryAttributes::LONG_NAME_MASK) == DirEntryAttributes::LONG_NAME ||
+            (dir.DIR_Attr & (DirEntryAttributes::DIRECTORY | DirEntryAttributes::VOLUME_ID)) != 0){
+        FAT_TRACE(FAT_TRACE_INFO, "directory entry is not a file");
+        return -1;
+    }
+    if(dir.DIR_Name[0] == 0x00 || dir.DIR_Name[0] == 0xE5){
+        FAT_TRACE(FAT_TRACE_INFO, "directory entry is free or deleted");
+        return -1;
     }
-    // check to see if the next_dir val is a directory
-    if(((next_dir.DIR_Attr & DirEntryAttributes::DIRECTORY) == DirEntryAttributes::DIRECTORY)){
-        std::cerr << "file " << path << " is a directory \n";
+    uint32_t cluster = get_dir_cluster_num(dir);
+    // an empty file may have no clusters at all
+    bool empty = cluster == 0 && dir.DIR_FileSize == 0;
+    if(!empty && (cluster < 2 || cluster >= vol.count_of_clusters + 2)){
+        FAT_TRACE(FAT_TRACE_WARN, "first cluster " << cluster << " is not on the volume");
         return -1;
     }
-    // add next_dir to the fdTable
-    fdTable.at(fdIndex).dir = next_dir;
-    fdTable.at(fdIndex).isEmpty = false;
-    return fdIndex;
+    return add_open_file(vol, dir);
 }
 
-bool fat_close(int fd) {
-    if(!infile.is_open()){  // check if a file is mounted
-        std::cerr << "no file has been mounted \n";
+bool close_file(FatVolume &vol, int fd) {
+    if(!vol.fds.close(fd)){
+        FAT_TRACE(FAT_TRACE_WARN, "fd " << fd << " has not been opened");
         return false;
     }
-    if(fdTable.at(fd).isEmpty){
-        std::cerr << "this file directory entry has not been opened\n";
+    return true;
+}
+
+// Calls visit(cluster, cluster_offset, length, position) for each run of physically
+// contiguous clusters holding count bytes at offset of the file laid out in extents: the
+// run starts cluster_offset bytes into cluster, and its data goes position bytes into the
+// range. The range must be within the file's size. Returns false if the cluster chain is
+// too short.
+template <typename Visit>
+bool visit_file_runs(const FatVolume &vol, const std::vector<Extent> &extents, uint32_t count, uint64_t offset, Visit visit) {
+    uint32_t file_cluster = offset / vol.cluster_size;
+    uint32_t updated_offset = offset % vol.cluster_size;
+    auto extent = find_extent(extents, file_cluster);
+    uint32_t bytes_read = 0;
+    while(bytes_read < count){
+        if(extent == extents.end()){
+            FAT_TRACE(FAT_TRACE_ERROR, "cluster chain is shorter than the file size");
+            return false;
+        }
+        // read as much of the rest of this run as is needed in a single call
+        uint32_t run_index = file_cluster - extent->file_cluster;
+        uint64_t run_bytes = (uint64_t)(extent->length - run_index) * vol.cluster_size - updated_offset;
+        uint32_t temp_count = (uint32_t) std::min<uint64_t>(run_bytes, count - bytes_read);
+        FAT_TRACE(FAT_TRACE_DEBUG, "reading cluster #" << file_cluster << "; bytes_read = " << bytes_read << "; offset = " << updated_offset << "; count = " << temp_count);
+        visit(extent->start + run_index, updated_offset, temp_count, bytes_read);
+        bytes_read += temp_count;
+        file_cluster = extent->file_cluster + extent->length;
+        updated_offset = 0;
+        ++extent;
+    }
+    return true;
+}
+
+// Appends the reads from the image that fetch count bytes at offset of the file laid out in
+// extents into buffer, one per run of clusters. Returns false if the cluster chain is too
+// short.
+bool plan_file_reads(const FatVolume &vol, const std::vector<Extent> &extents, char *buffer, uint32_t count,
+                     uint64_t offset, std::vector<IoRead> &reads) {
+    return visit_file_runs(vol, extents, count, offset, [&](uint32_t cluster, uint32_t start, uint32_t length, uint32_t position) {
+        reads.push_back({buffer + position, length, cluster_offset(vol, cluster) + start});
+    });
+}
+
+// Performs reads one after another on this thread
+bool read_image_sync(const FatVolume &vol, const std::vector<IoRead> &reads) {
+    for(const IoRead &read : reads){
+        if(!read_image(vol, read.buffer, read.offset, read.length)){
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reads count bytes at offset of the file laid out in extents. The range must be within
+// the file's size. With an I/O engine, the runs of clusters are submitted as one batch.
+bool read_file_data(const FatVolume &vol, const std::vector<Extent> &extents, char *buffer, uint32_t count, uint64_t offset) {
+    std::vector<IoRead> reads;
+    if(!plan_file_reads(vol, extents, buffer, count, offset, reads)){
+        return false;
+    }
+    if(!(vol.io ? vol.io->read(reads) : read_image_sync(vol, reads))){
+        FAT_TRACE(FAT_TRACE_ERROR, "could not read from the image");
         return false;
     }
-    fdTable.at(fd).isEmpty = true;
     return true;
 }
 
-int fat_pread(int fd, void *buffer, int count, int offset) {
-    if(!infile.is_open()){  // check if a file is mounted
-        std::cerr << "no file has been mounted \n";
-        return -1;
+std::atomic<size_t> readahead_size(2 * 1024 * 1024);
+
+void fat_set_readahead_size(size_t bytes) {
+    readahead_size.store(bytes);
+}
+
+Readahead::~Readahead() {
+    for(const Window &window : windows){
+        memory_budget.release(window.length);
     }
-    if(fdTable.at(fd).isEmpty) {
-        std::cerr << "a file descriptor with this val has not been set\n";
-        return -1;
+}
+
+// Copies as much of count bytes at offset as the windows of readahead hold, waiting for
+// windows still being read. Returns the number of bytes copied from the start.
+uint32_t read_from_readahead(Readahead &readahead, char *buffer, uint32_t count, uint64_t offset) {
+    std::vector<Readahead::Window> windows;
+    {
+        std::lock_guard<std::mutex> lock(readahead.mutex);
+        windows.assign(readahead.windows.begin(), readahead.windows.end());
+    }
+    uint32_t copied = 0;
+    for(const Readahead::Window &window : windows){
+        uint64_t pos = offset + copied;
+        if(copied == count || pos < window.offset){
+            break;
+        }
+        if(pos >= window.offset + window.length){
+            continue;
+        }
+        Readahead::Data data = window.data.get();
+        if(data->size() != window.length){
+            break;
+        }
+        uint32_t n = (uint32_t) std::min<uint64_t>(count - copied, window.offset + window.length - pos);
+        memcpy(buffer + copied, data->data() + (pos - window.offset), n);
+        copied += n;
+    }
+    return copied;
+}
+
+// Records a read of count bytes at offset. When it continues the previous read, windows the
+// reader has passed are dropped and new ones are started so two lie ahead of it; otherwise
+// readahead stops until reads are sequential again.
+void update_readahead(const FatVolume &vol, Readahead &readahead, const std::shared_ptr<const std::vector<Extent>> &extents,
+                      uint64_t file_size, uint64_t offset, uint32_t count) {
+    std::vector<Readahead::Window> dropped;     // destroyed after the lock is released
+    std::lock_guard<std::mutex> lock(readahead.mutex);
+    bool sequential = offset == readahead.next_offset;
+    readahead.next_offset = offset + count;
+    while(!readahead.windows.empty() &&
+          (!sequential || readahead.windows.front().offset + readahead.windows.front().length <= offset + count)){
+        memory_budget.release(readahead.windows.front().length);
+        dropped.push_back(readahead.windows.front());
+        readahead.windows.pop_front();
+    }
+    if(!sequential){
+        readahead.window_size = 0;
+        return;
+    }
+    if(readahead.window_size == 0){
+        readahead.window_size = std::min(readahead_initial_window, vol.readahead_size);
+    }
+    while(readahead.windows.size() < 2){
+        uint64_t start = readahead.windows.empty() ? offset + count
+                                                   : readahead.windows.back().offset + readahead.windows.back().length;
+        if(start >= file_size){
+            break;
+        }
+        uint32_t length = (uint32_t) std::min<uint64_t>(readahead.window_size, file_size - start);
+        if(!memory_budget.charge(length)){
+            break;
+        }
+        std::shared_future<Readahead::Data> data = std::async(std::launch::async, [&vol, extents, start, length]() {
+            std::shared_ptr<std::vector<char>> buffer = std::make_shared<std::vector<char>>(length);
+            if(!read_file_data(vol, *extents, buffer->data(), length, start)){
+                buffer->clear();
+            }
+            return Readahead::Data(buffer);
+        }).share();
+        readahead.windows.push_back({start, length, data});
+        FAT_TRACE(FAT_TRACE_DEBUG, "reading ahead " << length << " bytes at " << start);
+        readahead.window_size = std::min(readahead.window_size * 2, vol.readahead_size);
+    }
+}
+
+// What a read of an open file works from
+struct FileRead {
+    std::shared_ptr<const std::vector<Extent>> extents;
+    std::shared_ptr<Readahead> readahead;
+    int file_size;
+};
+
+// Looks fd up for a read of count bytes at offset and trims count to what the file holds,
+// which may be nothing. Returns false if fd is not open.
+bool begin_file_read(FatVolume &vol, int fd, int &count, int offset, FileRead &file) {
+    // get the directory from the file descriptor table; the slot stays pinned until we return
+    FdTable::Ref entry = vol.fds.acquire(fd);
+    if(!entry){
+        FAT_TRACE(FAT_TRACE_WARN, "fd " << fd << " has not been opened");
+        return false;
     }
-    // get the directory from the file descriptor table
-    DirEntry dir = fdTable.at(fd).dir;
-    int dir_file_size = (int) dir.DIR_FileSize;
+    const DirEntry &dir = entry->dir;
+    file.extents = entry->extents.load();
+    file.readahead = entry->readahead;
+    file.file_size = (int) dir.DIR_FileSize;
     // handle edge cases
-    if(count == 0 || offset > dir_file_size){
-        return 0;
+    if(count <= 0 || offset < 0 || offset > file.file_size){
+        count = 0;
+        return true;
     }
     // if we are trying to perform a read larger than the filesize, 
     // reduce the size of the read to the filesize.
-    if(offset + count > dir_file_size) {
-        count = dir_file_size - offset;
-    }
-    // Get all of the clusters for this file
-    int dirStartingCluster = get_dir_cluster_num(dir);
-    std::vector<int> cluster_nums = get_clusters_from_fat(dirStartingCluster);
-    int index_of_cluster = offset / cluster_size;
-    int updated_offset = offset % cluster_size;
-    int count_copy = count;
-    int temp_count;
-    int bytes_read = 0;
-    for(; bytes_read < count; bytes_read += temp_count){
-        int cur_cluster = cluster_nums.at(index_of_cluster);
-        std::cout << "reading cluster #" << index_of_cluster <<"; bytes_read = " << bytes_read << "; offset = "<< updated_offset << "\n";
-        index_of_cluster++;
-        uint32_t first_sector_of_cluster = ((cur_cluster - 2) * fatbpb->BPB_SecPerClus) + first_data_sector;
-        infile.seekg(first_sector_of_cluster * fatbpb->BPB_BytsPerSec + updated_offset);
-        if(updated_offset + count_copy > (int) cluster_size) {
-            temp_count = cluster_size - updated_offset;
-            count_copy -= (cluster_size - updated_offset);
-        } else {
-            temp_count = count_copy;
-            count_copy = 0;
-        }
-        if(updated_offset > 0){
-            updated_offset = 0;
+    if(count > file.file_size - offset) {
+        count = file.file_size - offset;
+    }
+    // Map the file's cluster chain once and reuse it for every later read
+    if(!file.extents){
+        file.extents = std::make_shared<const std::vector<Extent>>(get_extents_from_fat(vol, get_dir_cluster_num(dir)));
+        // if another read of this file got there first, keep its copy
+        std::shared_ptr<const std::vector<Extent>> expected;
+        entry->extents.compare_exchange_strong(expected, file.extents);
+    }
+    return true;
+}
+
+int pread_file(FatVolume &vol, int fd, void *buffer, int count, int offset) {
+    FileRead file;
+    if(!begin_file_read(vol, fd, count, offset, file)){
+        return -1;
+    }
+    if(count == 0){
+        return 0;
+    }
+    char *dest = (char *) buffer;
+    uint32_t copied = 0;
+    if(file.readahead){
+        copied = read_from_readahead(*file.readahead, dest, count, offset);
+        if(copied == (uint32_t) count){
+            vol.readahead_hits++;
         }
-        if(!(infile.read( &(((char *) buffer)[bytes_read]), temp_count))){
-            std::cerr << "could not read from memory";
+    }
+    if(!read_file_data(vol, *file.extents, dest + copied, count - copied, offset + copied)){
+        return -1;
+    }
+    if(file.readahead){
+        update_readahead(vol, *file.readahead, file.extents, file.file_size, offset, count);
+    }
+    return count;
+}
+
+// Fills view with spans covering count bytes at offset of fd, pointing into the mapping or
+// into blocks of the block cache, and pins what they point at.
+int view_file(FatVolume &vol, int fd, int count, int offset, FatView &view) {
+    view = FatView();
+    FileRead file;
+    if(!begin_file_read(vol, fd, count, offset, file)){
+        return -1;
+    }
+    if(count == 0){
+        return 0;
+    }
+    if(vol.image_map != nullptr){
+        bool in_image = true;
+        bool chain_ok = visit_file_runs(vol, *file.extents, count, offset, [&](uint32_t cluster, uint32_t start, uint32_t length, uint32_t) {
+            const char *data = mapped_data(vol, cluster_offset(vol, cluster) + start, length);
+            if(data == nullptr){
+                in_image = false;
+                return;
+            }
+            view.spans.push_back({data, length});
+        });
+        if(!chain_ok || !in_image){
+            view = FatView();
             return -1;
         }
+        view.pin = vol.image_mapping;
+        return count;
     }
+    // clusters come from the block cache, fetched in runs like directory clusters
+    std::shared_ptr<std::vector<BlockCache::Block>> pinned = std::make_shared<std::vector<BlockCache::Block>>();
+    uint32_t clusters_per_fetch = std::max<uint32_t>(1, max_dir_read_size / vol.cluster_size);
+    std::vector<BlockCache::Block> blocks;
+    bool read_ok = true;
+    bool chain_ok = visit_file_runs(vol, *file.extents, count, offset, [&](uint32_t cluster, uint32_t start, uint32_t length, uint32_t) {
+        uint32_t run_clusters = (uint32_t) (((uint64_t) start + length + vol.cluster_size - 1) / vol.cluster_size);
+        for(uint32_t first = 0; first < run_clusters && read_ok; first += clusters_per_fetch){
+            uint32_t fetch_count = std::min(clusters_per_fetch, run_clusters - first);
+            if(!vol.blocks.fetch(vol, cluster + first, fetch_count, blocks)){
+                read_ok = false;
+                return;
+            }
+            for(uint32_t i = 0; i < fetch_count; i++){
+                // the part of this cluster inside [start, start + length) of the run
+                uint64_t cluster_begin = (uint64_t) (first + i) * vol.cluster_size;
+                uint64_t from = std::max<uint64_t>(cluster_begin, start);
+                uint64_t to = std::min<uint64_t>(cluster_begin + vol.cluster_size, (uint64_t) start + length);
+                const char *data = blocks[i].get() + (from - cluster_begin);
+                size_t size = to - from;
+                if(!view.spans.empty() && view.spans.back().data + view.spans.back().size == data){
+                    // clusters read together sit next to each other in memory
+                    view.spans.back().size += size;
+                } else {
+                    view.spans.push_back({data, size});
+                }
+                pinned->push_back(blocks[i]);
+            }
+        }
+    });
+    if(!chain_ok || !read_ok){
+        FAT_TRACE(FAT_TRACE_ERROR, "could not read from the image");
+        view = FatView();
+        return -1;
+    }
+    view.pin = pinned;
     return count;
 }
 
-std::vector<AnyDirEntry> fat_readdir(const std::string &path) {
-    std::vector<AnyDirEntry> result;
-    if(!infile.is_open()){  // check if a file is mounted
-        std::cerr << "no file has been mounted \n";
-        return result;
+// Writes count bytes at offset of fd to out_fd, one run of clusters at a time, without
+// bringing the data into user space where the kernel allows it
+int send_file(FatVolume &vol, int fd, int out_fd, int count, int offset) {
+    FileRead file;
+    if(!begin_file_read(vol, fd, count, offset, file)){
+        return -1;
     }
-    if(!is_root_ref(path)){
-        std::cerr << "trying to read a path that is not indexed from the root\n";
-        return result;
+    SendMethod method = SendMethod::COPY_FILE_RANGE;
+    bool sent = true;
+    bool chain_ok = visit_file_runs(vol, *file.extents, count, offset, [&](uint32_t cluster, uint32_t start, uint32_t length, uint32_t) {
+        sent = sent && send_image_range(vol, cluster_offset(vol, cluster) + start, length, out_fd, method);
+    });
+    if(!chain_ok){
+        return -1;
     }
-    
-    std::vector<std::string> path_dirs;
-    split_path(path, path_dirs);
+    if(!sent){
+        FAT_TRACE(FAT_TRACE_ERROR, "could not send file data to fd " << out_fd << ": " << strerror(errno));
+        return -1;
+    }
+    return count;
+}
+
+// Gaps of up to this many bytes between the runs of a batch are read rather than skipped
+const uint64_t batch_merge_gap = 4096;
+// Upper bound on the size of one merged read in a batch
+const uint64_t max_batch_read = 1024 * 1024;
+
+// Reads a batch of requests, merging the runs of clusters behind them in image order
+bool preadv_files(FatVolume &vol, std::vector<FatReadRequest> &requests) {
+    // every run of clusters behind every request, with the request it belongs to
+    std::vector<IoRead> pieces;
+    std::vector<size_t> owners;
+    for(size_t i = 0; i < requests.size(); i++){
+        FatReadRequest &request = requests[i];
+        FileRead file;
+        int count = request.count;
+        if(!begin_file_read(vol, request.fd, count, request.offset, file)){
+            request.result = -1;
+            continue;
+        }
+        request.result = count;
+        if(count > 0 && !plan_file_reads(vol, *file.extents, (char *) request.buffer, count, request.offset, pieces)){
+            request.result = -1;
+        }
+        owners.resize(pieces.size(), i);
+    }
+    std::vector<size_t> order(pieces.size());
+    for(size_t i = 0; i < order.size(); i++){
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&pieces](size_t a, size_t b) { return pieces[a].offset < pieces[b].offset; });
 
-    uint32_t cur_folder_cluster = root_cluster_32;
-    for(int i = 0; i <= (int)path_dirs.size(); i++){
-        if(cur_folder_cluster == 0) cur_folder_cluster = root_cluster_32;
-        if(i == (int) path_dirs.size()){
-            std::vector<DirEntry> dir_entries;
-            dir_entries = read_cluster(cur_folder_cluster);
-            for(DirEntry dir : dir_entries){
-                AnyDirEntry ade;
-                ade.dir = dir;
-                result.push_back(ade); 
+    // merge neighbouring pieces into reads of a shared buffer, which are then copied out
+    struct Merged {
+        IoRead read;
+        size_t first, last;     // range of order the read covers
+    };
+    std::vector<Merged> merged;
+    std::vector<std::unique_ptr<char[]>> buffers;
+    for(size_t i = 0; i < order.size(); ){
+        const IoRead &first = pieces[order[i]];
+        uint64_t end = first.offset + first.length;
+        size_t j = i + 1;
+        while(j < order.size()){
+            const IoRead &next = pieces[order[j]];
+            uint64_t new_end = std::max<uint64_t>(end, next.offset + next.length);
+            if(next.offset > end + batch_merge_gap || new_end - first.offset > max_batch_read){
+                break;
+            }
+            end = new_end;
+            j++;
+        }
+        if(j == i + 1 || vol.image_map != nullptr){
+            // a single piece, or a mapped image that is copied from directly, needs no buffer
+            for(size_t k = i; k < j; k++){
+                merged.push_back({pieces[order[k]], k, k});
             }
         } else {
-            DirEntry next_folder;
-            std::string dir_name = path_dirs.at(i);
-            bool found_folder = get_dir_entry(cur_folder_cluster, dir_name, next_folder);
-            if(!found_folder){
-                std::cerr << "could not find folder with name " << dir_name << "\n";
-                return result;
+            buffers.emplace_back(new char[end - first.offset]);
+            merged.push_back({{buffers.back().get(), (uint32_t) (end - first.offset), first.offset}, i, j - 1});
+        }
+        i = j;
+    }
+    FAT_TRACE(FAT_TRACE_DEBUG, "batch of " << requests.size() << " requests, " << pieces.size() << " runs, "
+              << merged.size() << " reads");
+
+    bool engine_ok = true;
+    if(vol.io){
+        std::vector<IoRead> reads;
+        for(const Merged &m : merged){
+            reads.push_back(m.read);
+        }
+        engine_ok = vol.io->read(reads);
+    }
+    for(const Merged &m : merged){
+        // the engine can't tell which read failed, so then every request fails
+        bool read_ok = vol.io ? engine_ok : read_image(vol, m.read.buffer, m.read.offset, m.read.length);
+        if(!read_ok){
+            for(size_t k = m.first; k <= m.last; k++){
+                requests[owners[order[k]]].result = -1;
+            }
+            continue;
+        }
+        for(size_t k = m.first; k <= m.last; k++){
+            const IoRead &piece = pieces[order[k]];
+            if(piece.buffer != m.read.buffer){
+                memcpy(piece.buffer, m.read.buffer + (piece.offset - m.read.offset), piece.length);
+            }
+        }
+    }
+    bool all_ok = true;
+    for(const FatReadRequest &request : requests){
+        if(request.result < 0){
+            all_ok = false;
+        }
+    }
+    return all_ok;
+}
+
+// Starts a read like pread_file() and calls complete with its result once it has finished,
+// from an I/O engine thread or, without an engine, before returning. It doesn't read
+// ahead; callers issuing asynchronous reads keep their own reads in flight.
+void pread_file_async(FatVolume &vol, int fd, void *buffer, int count, int offset, std::function<void(int)> complete) {
+    FileRead file;
+    if(!begin_file_read(vol, fd, count, offset, file)){
+        complete(-1);
+        return;
+    }
+    std::vector<IoRead> reads;
+    if(!plan_file_reads(vol, *file.extents, (char *) buffer, count, offset, reads)){
+        complete(-1);
+        return;
+    }
+    if(!vol.io){
+        complete(read_image_sync(vol, reads) ? count : -1);
+        return;
+    }
+    vol.async.start();
+    vol.io->submit(reads, [&vol, count, complete](bool ok) {
+        if(!ok){
+            FAT_TRACE(FAT_TRACE_ERROR, "could not read from the image");
+        }
+        complete(ok ? count : -1);
+        vol.async.finish();
+    });
+}
+
+// Fetches the next run of the stream's directory into state.clusters. Returns false at the
+// end of the directory or if it could not be read.
+bool fetch_dir_run(FatDirStream::State &state) {
+    const FatVolume &vol = *state.vol;
+    if(state.extent == state.extents.size()){
+        return false;
+    }
+    const Extent &extent = state.extents[state.extent];
+    uint32_t clusters_per_read = std::max<uint32_t>(1, max_dir_read_size / vol.cluster_size);
+    uint32_t run_count = std::min(clusters_per_read, extent.length - state.run_index);
+    uint32_t run_start = extent.start + state.run_index;
+    state.clusters.clear();
+    if(vol.image_map != nullptr){
+        const char *run = mapped_data(vol, cluster_offset(vol, run_start), (uint64_t) run_count * vol.cluster_size);
+        if(run == nullptr){
+            state.ok = false;
+            return false;
+        }
+        for(uint32_t i = 0; i < run_count; i++){
+            state.clusters.push_back(run + (uint64_t) i * vol.cluster_size);
+        }
+    } else {
+        if(!vol.blocks.fetch(vol, run_start, run_count, state.blocks)){
+            FAT_TRACE(FAT_TRACE_ERROR, "could not read directory cluster " << run_start);
+            state.ok = false;
+            return false;
+        }
+        for(const BlockCache::Block &block : state.blocks){
+            state.clusters.push_back(block.get());
+        }
+    }
+    state.next_cluster = 0;
+    state.run_index += run_count;
+    if(state.run_index == extent.length){
+        state.extent++;
+        state.run_index = 0;
+    }
+    return true;
+}
+
+FatDirStream::FatDirStream(const std::string &path): FatDirStream(mounted_volume, path) {}
+
+FatDirStream::FatDirStream(FatVolume *vol, const std::string &path): state(std::make_unique<State>()) {
+    state->vol = vol;
+    if(vol == nullptr){
+        FAT_TRACE(FAT_TRACE_WARN, "no file has been mounted");
+        state->ok = false;
+        return;
+    }
+    if(!is_root_ref(path)){
+        FAT_TRACE(FAT_TRACE_WARN, "trying to read a path that is not indexed from the root: " << path);
+        state->ok = false;
+        return;
+    }
+    DirEntry folder;
+    uint32_t cluster;
+    if(!resolve_path(*vol, path, folder, cluster)){
+        state->ok = false;
+        return;
+    }
+    state->extents = get_extents_from_fat(*vol, cluster);
+}
+
+FatDirStream::~FatDirStream() {}
+
+FatDirStream::iterator FatDirStream::begin() {
+    if(!state->started){
+        state->started = true;
+        advance();
+    }
+    return iterator(this);
+}
+
+bool FatDirStream::ok() const {
+    return state->ok;
+}
+
+void FatDirStream::advance() {
+    State &s = *state;
+    current = nullptr;
+    if(!s.ok){
+        return;
+    }
+    uint32_t entries_per_cluster = s.vol->cluster_size / s.vol->dir_entry_size;
+    while(true){
+        if(s.cluster != nullptr){
+            // every kind of entry is listed, deleted ones included, up to the first free one
+            const char *entry = s.cluster + (size_t) s.entry * s.vol->dir_entry_size;
+            if(s.entry < entries_per_cluster && entry[0] != 0x00){
+                s.entry++;
+                current = (const AnyDirEntry *) entry;
+                return;
             }
-            cur_folder_cluster = get_dir_cluster_num(next_folder);
+            s.cluster = nullptr;
+        }
+        if(s.next_cluster == s.clusters.size() && !fetch_dir_run(s)){
+            return;
         }
+        s.cluster = s.clusters[s.next_cluster++];
+        s.entry = 0;
+    }
+}
 
+std::vector<AnyDirEntry> read_dir(FatVolume &vol, const std::string &path) {
+    std::vector<AnyDirEntry> result;
+    FatDirStream dir(&vol, path);
+    for(const AnyDirEntry &entry : dir){
+        result.push_back(entry);
     }
     return result;
 }
+
+int fat_volume_open(FatVolume *vol, const std::string &path) {
+    if(vol == nullptr){  // check if a file is mounted
+        FAT_TRACE(FAT_TRACE_WARN, "no file has been mounted");
+        return -1;
+    }
+    return open_file(*vol, path);
+}
+
+int fat_volume_open_entry(FatVolume *vol, const DirEntry &entry) {
+    if(vol == nullptr){
+        FAT_TRACE(FAT_TRACE_WARN, "no file has been mounted");
+        return -1;
+    }
+    return open_entry(*vol, entry);
+}
+
+int fat_volume_open_cluster(FatVolume *vol, uint32_t first_cluster, uint32_t size) {
+    DirEntry entry = {};
+    memset(entry.DIR_Name, ' ', sizeof(entry.DIR_Name));
+    entry.DIR_Name[0] = '_';
+    entry.DIR_Attr = DirEntryAttributes::ARCHIVE;
+    entry.DIR_FstClusHI = first_cluster >> 16;
+    entry.DIR_FstClusLO = first_cluster & 0xFFFF;
+    entry.DIR_FileSize = size;
+    return fat_volume_open_entry(vol, entry);
+}
+
+bool fat_volume_close(FatVolume *vol, int fd) {
+    if(vol == nullptr){  // check if a file is mounted
+        FAT_TRACE(FAT_TRACE_WARN, "no file has been mounted");
+        return false;
+    }
+    return close_file(*vol, fd);
+}
+
+int fat_volume_pread(FatVolume *vol, int fd, void *buffer, int count, int offset) {
+    if(vol == nullptr){  // check if a file is mounted
+        FAT_TRACE(FAT_TRACE_WARN, "no file has been mounted");
+        return -1;
+    }
+    return pread_file(*vol, fd, buffer, count, offset);
+}
+
+std::future<int> fat_volume_pread_async(FatVolume *vol, int fd, void *buffer, int count, int offset) {
+    std::shared_ptr<std::promise<int>> result = std::make_shared<std::promise<int>>();
+    std::future<int> future = result->get_future();
+    if(vol == nullptr){
+        FAT_TRACE(FAT_TRACE_WARN, "no file has been mounted");
+        result->set_value(-1);
+        return future;
+    }
+    pread_file_async(*vol, fd, buffer, count, offset, [result](int n) { result->set_value(n); });
+    return future;
+}
+
+void fat_volume_pread_async(FatVolume *vol, int fd, void *buffer, int count, int offset, FatReadCallback done) {
+    if(vol == nullptr){
+        // there is no volume to queue the callback on
+        FAT_TRACE(FAT_TRACE_WARN, "no file has been mounted");
+        done(-1);
+        return;
+    }
+    pread_file_async(*vol, fd, buffer, count, offset, [vol, done](int n) {
+        vol->async.post([done, n] { done(n); });
+    });
+}
+
+int fat_volume_poll(FatVolume *vol) {
+    return vol == nullptr ? 0 : vol->async.poll();
+}
+
+int fat_volume_event_fd(FatVolume *vol) {
+    return vol == nullptr ? -1 : vol->async.get_event_fd();
+}
+
+int fat_volume_sendfile(FatVolume *vol, int fd, int out_fd, int count, int offset) {
+    if(vol == nullptr){
+        FAT_TRACE(FAT_TRACE_WARN, "no file has been mounted");
+        return -1;
+    }
+    return send_file(*vol, fd, out_fd, count, offset);
+}
+
+int fat_volume_view(FatVolume *vol, int fd, int count, int offset, FatView &view) {
+    if(vol == nullptr){
+        FAT_TRACE(FAT_TRACE_WARN, "no file has been mounted");
+        view = FatView();
+        return -1;
+    }
+    return view_file(*vol, fd, count, offset, view);
+}
+
+bool fat_volume_preadv(FatVolume *vol, std::vector<FatReadRequest> &requests) {
+    if(vol == nullptr){
+        FAT_TRACE(FAT_TRACE_WARN, "no file has been mounted");
+        for(FatReadRequest &request : requests){
+            request.result = -1;
+        }
+        return requests.empty();
+    }
+    return preadv_files(*vol, requests);
+}
+
+std::vector<AnyDirEntry> fat_volume_readdir(FatVolume *vol, const std::string &path) {
+    if(vol == nullptr){  // check if a file is mounted
+        FAT_TRACE(FAT_TRACE_WARN, "no file has been mounted");
+        return std::vector<AnyDirEntry>();
+    }
+    return read_dir(*vol, path);
+}
+
+FatIoEngine fat_volume_io_engine(FatVolume *vol) {
+    if(vol == nullptr || !vol->io){
+        return FAT_IO_SYNC;
+    }
+    return vol->io->kind();
+}
+
+FatCacheStats fat_volume_cache_stats(FatVolume *vol) {
+    FatCacheStats stats = FatCacheStats();
+    if(vol != nullptr){
+        stats.block_hits = vol->blocks.hits.load();
+        stats.block_misses = vol->blocks.misses.load();
+        stats.dentry_hits = vol->dentries.hits.load();
+        stats.dentry_misses = vol->dentries.misses.load();
+        stats.dir_index_hits = vol->dir_indexes.hits.load();
+        stats.dir_index_misses = vol->dir_indexes.misses.load();
+        stats.readahead_hits = vol->readahead_hits.load();
+    }
+    return stats;
+}
+
+int fat_open(const std::string &path) {
+    return fat_volume_open(mounted_volume, path);
+}
+
+int fat_open_entry(const DirEntry &entry) {
+    return fat_volume_open_entry(mounted_volume, entry);
+}
+
+int fat_open_cluster(uint32_t first_cluster, uint32_t size) {
+    return fat_volume_open_cluster(mounted_volume, first_cluster, size);
+}
+
+bool fat_close(int fd) {
+    return fat_volume_close(mounted_volume, fd);
+}
+
+int fat_pread(int fd, void *buffer, int count, int offset) {
+    return fat_volume_pread(mounted_volume, fd, buffer, count, offset);
+}
+
+std::future<int> fat_pread_async(int fd, void *buffer, int count, int offset) {
+    return fat_volume_pread_async(mounted_volume, fd, buffer, count, offset);
+}
+
+void fat_pread_async(int fd, void *buffer, int count, int offset, FatReadCallback done) {
+    fat_volume_pread_async(mounted_volume, fd, buffer, count, offset, done);
+}
+
+int fat_poll() {
+    return fat_volume_poll(mounted_volume);
+}
+
+int fat_event_fd() {
+    return fat_volume_event_fd(mounted_volume);
+}
+
+int fat_sendfile(int fd, int out_fd, int count, int offset) {
+    return fat_volume_sendfile(mounted_volume, fd, out_fd, count, offset);
+}
+
+int fat_view(int fd, int count, int offset, FatView &view) {
+    return fat_volume_view(mounted_volume, fd, count, offset, view);
+}
+
+bool fat_preadv(std::vector<FatReadRequest> &requests) {
+    return fat_volume_preadv(mounted_volume, requests);
+}
+
+std::vector<AnyDirEntry> fat_readdir(const std::string &path) {
+    return fat_volume_readdir(mounted_volume, path);
+}
@@ -1,7 +1,13 @@
 #ifndef FAT_H_
 #define FAT_H_
 
+#include <cstddef>
 #include <cstdint>
+#include <ctime>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <memory>
 #include <vector>
 #include <string>
 
@@ -64,17 +70,308 @@ enum DirEntryAttributes {
     LONG_NAME_MASK  = 0x3F,
 };
 
-struct FDEntry {
-    DirEntry dir;
-    bool isEmpty;
-    FDEntry(): isEmpty(true) {}
+/* How fat_mount() reads the disk image. FAT_MOUNT_READ copies data out of the image file
+ * on every access; FAT_MOUNT_MMAP maps the whole image into memory once, so cluster reads
+ * become pointer arithmetic into the mapping and directory scans walk it in place.
+ */
+enum FatMountMode {
+    FAT_MOUNT_READ,
+    FAT_MOUNT_MMAP,
+};
+
+/* A run of physically contiguous clusters in a file's cluster chain. file_cluster is the index
+ * of the run's first cluster within the file, start is its cluster number on disk.
+ */
+struct Extent {
+    uint32_t file_cluster;
+    uint32_t start;
+    uint32_t length;    // number of clusters in the run
 };
 
+/* Verbosity of the library's diagnostics. Messages at or below the level passed to
+ * fat_set_trace_level() are handed to the trace sink; the default is FAT_TRACE_OFF, so the
+ * library prints nothing unless asked to. Building with -DFAT_TRACE_MAX_LEVEL=<level>
+ * removes every message above that level at compile time.
+ */
+enum FatTraceLevel {
+    FAT_TRACE_OFF,
+    FAT_TRACE_ERROR,    // I/O failures and corrupt images
+    FAT_TRACE_WARN,     // calls that were rejected, e.g. a bad fd or nothing mounted
+    FAT_TRACE_INFO,     // lookups that failed
+    FAT_TRACE_DEBUG,    // individual reads, very verbose
+};
+
+/* Receives each trace message. The default sink writes to stderr. */
+typedef std::function<void(FatTraceLevel, const std::string &)> FatTraceSink;
+
+extern void fat_set_trace_level(FatTraceLevel level);
+extern void fat_set_trace_sink(FatTraceSink sink);
+
 /* These are the functions you need to implement */
-extern bool fat_mount(const std::string &path);
+extern bool fat_mount(const std::string &path, FatMountMode mode = FAT_MOUNT_READ);
 extern int fat_open(const std::string &path);
 extern bool fat_close(int fd);
 extern int fat_pread(int fd, void *buffer, int count, int offset);
 extern std::vector<AnyDirEntry> fat_readdir(const std::string &path);
 
+/* A mounted image. Any number of volumes can be mounted at once; each has its own file
+ * descriptors, and the functions above act on the one mounted by fat_mount().
+ * fat_volume_mount() returns nullptr on failure.
+ */
+struct FatVolume;
+
+extern FatVolume *fat_volume_mount(const std::string &path, FatMountMode mode = FAT_MOUNT_READ);
+extern void fat_volume_unmount(FatVolume *vol);
+extern int fat_volume_open(FatVolume *vol, const std::string &path);
+extern bool fat_volume_close(FatVolume *vol, int fd);
+extern int fat_volume_pread(FatVolume *vol, int fd, void *buffer, int count, int offset);
+extern std::vector<AnyDirEntry> fat_volume_readdir(FatVolume *vol, const std::string &path);
+extern FatVolume *fat_mounted_volume();     // the volume mounted by fat_mount(), or nullptr
+
+/* A directory listed lazily, e.g.
+ *
+ *     FatDirStream dir(vol, "/people");
+ *     for (const AnyDirEntry &entry : dir) {
+ *         if (...) break;
+ *     }
+ *     if (!dir.ok()) ...
+ *
+ * It yields the entries fat_readdir() would return, in the same order, but reads the
+ * directory a cluster at a time as the loop reaches it, so the first entries arrive
+ * without reading the rest and stopping early skips it. Each entry is a reference into the
+ * cluster it was read from rather than a copy, valid until the stream moves past that
+ * cluster. The volume must stay mounted while the stream is in use.
+ */
+class FatDirStream {
+public:
+    class iterator {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef AnyDirEntry value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const AnyDirEntry *pointer;
+        typedef const AnyDirEntry &reference;
+
+        iterator(): stream(nullptr) {}
+        reference operator*() const { return *stream->current; }
+        pointer operator->() const { return stream->current; }
+        iterator &operator++() { stream->advance(); return *this; }
+        void operator++(int) { stream->advance(); }
+        bool operator==(std::default_sentinel_t) const { return stream == nullptr || stream->current == nullptr; }
+
+    private:
+        friend class FatDirStream;
+        explicit iterator(FatDirStream *stream): stream(stream) {}
+        FatDirStream *stream;
+    };
+
+    explicit FatDirStream(const std::string &path);     // lists path on the volume mounted by fat_mount()
+    FatDirStream(FatVolume *vol, const std::string &path);
+    ~FatDirStream();
+    FatDirStream(const FatDirStream &) = delete;
+    FatDirStream &operator=(const FatDirStream &) = delete;
+
+    iterator begin();   // the first entry not yet listed
+    std::default_sentinel_t end() const { return std::default_sentinel; }
+    // false if the path was not a directory or part of it could not be read
+    bool ok() const;
+
+    struct State;
+
+private:
+    void advance();
+
+    std::unique_ptr<State> state;
+    const AnyDirEntry *current = nullptr;
+};
+
+/* One file or directory found by fat_walk() */
+struct FatFileInfo {
+    std::string path;           // the walked path followed by names as stored, e.g. "/people/YYZ5W"
+    uint8_t attributes;         // DirEntryAttributes
+    uint32_t size;
+    uint32_t first_cluster;
+    time_t created;             // the entry's timestamps read as UTC, 0 when unset
+    time_t modified;
+    time_t accessed;            // a date only
+    DirEntry entry;             // as stored, e.g. for fat_open_entry()
+};
+
+typedef std::function<void(const FatFileInfo &info)> FatWalkCallback;
+
+/* Lists every file and directory below the directory path, calling visit once for each,
+ * except . and .. entries. Directories are listed in parallel by threads threads
+ * (0 for one per core) that steal work from one another. visit is called from those
+ * threads concurrently and in no particular order, and must not throw. Returns false if
+ * path is not a directory or part of the tree could not be read.
+ */
+extern bool fat_walk(const std::string &path, FatWalkCallback visit, unsigned threads = 0);
+extern bool fat_volume_walk(FatVolume *vol, const std::string &path, FatWalkCallback visit, unsigned threads = 0);
+
+/* Copies the directory path and everything below it into host_dir, creating host_dir if
+ * it is missing (its parent must exist). Files are read in the order of their first
+ * clusters, so the image is read mostly front to back, and the data already read is
+ * written by threads writer threads (0 for one per core) meanwhile. Names are kept as
+ * stored, and files keep their modification times. stats, if given, counts what was
+ * found. Returns false if anything could not be read or written; the rest is still
+ * extracted.
+ */
+struct FatExtractStats {
+    size_t files = 0;
+    size_t directories = 0;
+    uint64_t bytes = 0;
+};
+
+extern bool fat_extract(const std::string &path, const std::string &host_dir, unsigned threads = 0,
+                        FatExtractStats *stats = nullptr);
+extern bool fat_volume_extract(FatVolume *vol, const std::string &path, const std::string &host_dir,
+                               unsigned threads = 0, FatExtractStats *stats = nullptr);
+
+/* Open a file without resolving a path, from an entry returned by fat_readdir() or from
+ * the first cluster and size such an entry holds, so a caller that has already listed a
+ * directory doesn't walk it again. The entry must be a live file, not a directory, volume
+ * label or long name part. Returns a descriptor as fat_open() does, or -1.
+ */
+extern int fat_open_entry(const DirEntry &entry);
+extern int fat_open_cluster(uint32_t first_cluster, uint32_t size);
+extern int fat_volume_open_entry(FatVolume *vol, const DirEntry &entry);
+extern int fat_volume_open_cluster(FatVolume *vol, uint32_t first_cluster, uint32_t size);
+
+/* Zero-copy reads. fat_view() describes count bytes at offset of an open file as spans of
+ * read-only memory in file order, pointing straight into the mapped image for
+ * FAT_MOUNT_MMAP volumes and into the volume's block cache otherwise, so the data can be
+ * hashed or sent without copying it into a buffer first. The view pins that memory: it
+ * stays valid, even across fat_close() or unmounting, until the FatView is reset or
+ * destroyed. Returns the number of bytes covered, or -1 on error.
+ */
+struct FatSpan {
+    const char *data;
+    size_t size;
+};
+
+struct FatView {
+    std::vector<FatSpan> spans;
+    std::shared_ptr<const void> pin;    // keeps the spans' memory alive
+};
+
+extern int fat_view(int fd, int count, int offset, FatView &view);
+extern int fat_volume_view(FatVolume *vol, int fd, int count, int offset, FatView &view);
+
+/* Writes count bytes at offset of an open file to out_fd, a file, pipe or socket, at
+ * out_fd's current position. The file's cluster runs are handed to copy_file_range(),
+ * sendfile() or splice(), whichever works for out_fd, so the data doesn't pass through a
+ * user buffer; FAT_MOUNT_MMAP volumes write straight from the mapping. Returns the number
+ * of bytes written, as fat_pread() would for the same range, or -1 on error, in which case
+ * part of the range may have been written.
+ */
+extern int fat_sendfile(int fd, int out_fd, int count, int offset);
+extern int fat_volume_sendfile(FatVolume *vol, int fd, int out_fd, int count, int offset);
+
+/* One range to read in a batch. result is filled in with what fat_pread() would have
+ * returned for it.
+ */
+struct FatReadRequest {
+    int fd;
+    void *buffer;
+    int count;
+    int offset;
+    int result;
+};
+
+/* Reads every request in one pass over the image: the cluster runs behind all of them
+ * are sorted by their position in the image, and runs that touch or nearly touch are read
+ * with a single call. Requests may name different files and overlap. Returns false if any
+ * request failed.
+ */
+extern bool fat_preadv(std::vector<FatReadRequest> &requests);
+extern bool fat_volume_preadv(FatVolume *vol, std::vector<FatReadRequest> &requests);
+
+/* Asynchronous reads. These start a read like fat_pread() and return at once; buffer must
+ * stay valid until the read has completed. The future form completes by itself. The
+ * callback form queues done, called with what fat_pread() would have returned, until the
+ * program calls fat_poll(), so one event loop thread can run callbacks for thousands of
+ * reads. fat_event_fd() returns an eventfd that is readable while fat_poll() has callbacks
+ * to run, for adding to poll() or epoll. Reads are only truly asynchronous on volumes with
+ * an I/O engine (see fat_set_io_engine()); otherwise they finish before returning. A
+ * volume must not be unmounted while it has reads in flight.
+ */
+typedef std::function<void(int result)> FatReadCallback;
+
+extern std::future<int> fat_pread_async(int fd, void *buffer, int count, int offset);
+extern void fat_pread_async(int fd, void *buffer, int count, int offset, FatReadCallback done);
+extern int fat_poll();          // runs the callbacks of finished reads and returns how many ran
+extern int fat_event_fd();      // -1 if it can't be created or nothing is mounted
+extern std::future<int> fat_volume_pread_async(FatVolume *vol, int fd, void *buffer, int count, int offset);
+extern void fat_volume_pread_async(FatVolume *vol, int fd, void *buffer, int count, int offset, FatReadCallback done);
+extern int fat_volume_poll(FatVolume *vol);
+extern int fat_volume_event_fd(FatVolume *vol);
+
+/* Caps the memory that all mounted volumes together may use for FAT tables and caches.
+ * Once it is reached, caches evict their least recently used data or go uncached.
+ * The default is no limit.
+ */
+extern void fat_set_memory_budget(size_t bytes);
+extern size_t fat_memory_in_use();
+
+/* The FAT is loaded on demand in 4 KiB pages. This caps how many bytes of it each volume
+ * keeps in memory; it applies to volumes mounted afterwards. The default is 16 MiB.
+ */
+extern void fat_set_fat_cache_size(size_t bytes);
+
+/* Directory clusters are kept in a per-volume block cache. This caps its size in bytes for
+ * volumes mounted afterwards; the default is 8 MiB and 0 disables it. Images mounted with
+ * FAT_MOUNT_MMAP read directories straight from the mapping and never use it.
+ */
+extern void fat_set_block_cache_size(size_t bytes);
+
+/* Paths resolved by fat_open() and fat_readdir() are cached per volume, including paths
+ * that do not exist. This caps that cache's size in bytes for volumes mounted afterwards;
+ * the default is 4 MiB and 0 disables it.
+ */
+extern void fat_set_dentry_cache_size(size_t bytes);
+
+/* The first lookup in a directory reads all of it into a hash index of its names, so later
+ * lookups there don't scan it. This caps the size in bytes of those indexes for volumes
+ * mounted afterwards; the default is 16 MiB and 0 disables keeping them.
+ */
+extern void fat_set_dir_index_cache_size(size_t bytes);
+
+/* Reads that continue where the previous read of the same file descriptor stopped start
+ * reading the following data on another thread. The first window is 128 KiB and each one
+ * after it is twice as large, up to this size in bytes; the default is 2 MiB and 0 turns
+ * readahead off. It applies to volumes mounted afterwards, except FAT_MOUNT_MMAP ones,
+ * which read straight from the mapping.
+ */
+extern void fat_set_readahead_size(size_t bytes);
+
+/* How a volume mounted with FAT_MOUNT_READ reads file data. FAT_IO_SYNC calls pread() on
+ * the calling thread, one run of clusters after another. FAT_IO_THREADS hands the runs of a
+ * read to a small pool of threads, and FAT_IO_URING submits them to an io_uring as one
+ * batch, so many reads in flight keep the device's queue full. FAT_IO_URING falls back to
+ * FAT_IO_THREADS where the kernel doesn't support io_uring.
+ */
+enum FatIoEngine {
+    FAT_IO_SYNC,
+    FAT_IO_THREADS,
+    FAT_IO_URING,
+};
+
+/* Sets the I/O engine for volumes mounted afterwards; the default is FAT_IO_SYNC */
+extern void fat_set_io_engine(FatIoEngine engine);
+/* The engine vol actually uses, FAT_IO_SYNC for FAT_MOUNT_MMAP volumes */
+extern FatIoEngine fat_volume_io_engine(FatVolume *vol);
+
+/* Counters for the caches of a volume */
+struct FatCacheStats {
+    uint64_t block_hits;
+    uint64_t block_misses;
+    uint64_t dentry_hits;
+    uint64_t dentry_misses;
+    uint64_t dir_index_hits;
+    uint64_t dir_index_misses;
+    uint64_t readahead_hits;    // fat_pread() calls served entirely from prefetched data
+};
+
+extern FatCacheStats fat_volume_cache_stats(FatVolume *vol);
+
 #endif
@@ -0,0 +1,160 @@
+#include "fat_internal.h"
+#include <algorithm>
+
+std::atomic<size_t> fat_cache_size(16 * 1024 * 1024);
+std::atomic<size_t> block_cache_size(8 * 1024 * 1024);
+std::atomic<size_t> dentry_cache_size(4 * 1024 * 1024);
+std::atomic<size_t> dir_index_cache_size(16 * 1024 * 1024);
+
+// rough cost of one cached path: the Dentry, its key, and the map and list nodes
+const size_t dentry_bytes = sizeof(Dentry) + 128;
+// rough cost of one entry of a directory index, counted the same way
+const size_t dir_index_entry_bytes = sizeof(DirEntry) + 64;
+
+void fat_set_fat_cache_size(size_t bytes) {
+    fat_cache_size.store(bytes);
+}
+
+FatTable::Page FatTable::page(const FatVolume &vol, uint32_t page_no) {
+    uint64_t page_offset = (uint64_t) page_no * fat_page_entries * 4;
+    if(page_offset >= size){
+        return nullptr;
+    }
+    if(map != nullptr){
+        // doesn't own anything: the mapping lives as long as the volume
+        return Page(Page(), (const uint32_t *)(map + page_offset));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Page page = pages.find(page_no);
+        if(page){
+            return page;
+        }
+    }
+    // read the page without holding the lock, so other threads can keep walking chains
+    std::shared_ptr<std::vector<uint32_t>> data = std::make_shared<std::vector<uint32_t>>(fat_page_entries, 0);
+    uint32_t length = (uint32_t) std::min<uint64_t>(fat_page_entries * 4, size - page_offset);
+    if(!read_image(vol, (char *) data->data(), offset + page_offset, length)){
+        FAT_TRACE(FAT_TRACE_ERROR, "could not read fat page " << page_no);
+        return nullptr;
+    }
+    Page page(data, data->data());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    Page loaded = pages.find(page_no);
+    if(loaded){
+        // another thread read it in the meantime
+        return loaded;
+    }
+    // if the budget is held by other volumes, the page is used without being cached
+    pages.insert(page_no, page);
+    return page;
+}
+
+void fat_set_block_cache_size(size_t bytes) {
+    block_cache_size.store(bytes);
+}
+
+void BlockCache::configure(size_t block_size, size_t capacity) {
+    size_t total_blocks = capacity / block_size;
+    for(Shard &shard : shards){
+        shard.blocks.value_bytes = block_size;
+        shard.blocks.capacity = (total_blocks + block_cache_shards - 1) / block_cache_shards * block_size;
+    }
+}
+
+bool BlockCache::fetch(const FatVolume &vol, uint32_t cluster, uint32_t count, std::vector<Block> &blocks) {
+    blocks.assign(count, nullptr);
+    for(uint32_t i = 0; i < count; i++){
+        Shard &shard = shards[(cluster + i) % block_cache_shards];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        blocks[i] = shard.blocks.find(cluster + i);
+    }
+    for(uint32_t i = 0; i < count; ){
+        if(blocks[i]){
+            hits++;
+            i++;
+            continue;
+        }
+        // read this cluster and every missing one right after it in one call
+        uint32_t missing = 1;
+        while(i + missing < count && !blocks[i + missing]){
+            missing++;
+        }
+        misses += missing;
+        // each block points into the buffer for the whole run, so nothing is copied
+        std::shared_ptr<std::vector<char>> run = std::make_shared<std::vector<char>>((size_t) missing * vol.cluster_size);
+        if(!read_image(vol, run->data(), cluster_offset(vol, cluster + i), run->size())){
+            return false;
+        }
+        for(uint32_t j = 0; j < missing; j++){
+            blocks[i + j] = Block(run, run->data() + (size_t) j * vol.cluster_size);
+            Shard &shard = shards[(cluster + i + j) % block_cache_shards];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.blocks.insert(cluster + i + j, blocks[i + j]);
+        }
+        i += missing;
+    }
+    return true;
+}
+
+void fat_set_dentry_cache_size(size_t bytes) {
+    dentry_cache_size.store(bytes);
+}
+
+void DentryCache::configure(size_t capacity) {
+    size_t total = capacity / dentry_bytes;
+    for(Shard &shard : shards){
+        shard.dentries.value_bytes = dentry_bytes;
+        shard.dentries.capacity = (total + block_cache_shards - 1) / block_cache_shards * dentry_bytes;
+    }
+}
+
+DentryCache::Value DentryCache::find(const std::string &path) {
+    Shard &shard = shards[std::hash<std::string>()(path) % block_cache_shards];
+    Value dentry;
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        dentry = shard.dentries.find(path);
+    }
+    if(dentry){
+        hits++;
+    } else {
+        misses++;
+    }
+    return dentry;
+}
+
+void DentryCache::insert(const std::string &path, const Value &dentry) {
+    Shard &shard = shards[std::hash<std::string>()(path) % block_cache_shards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.dentries.insert(path, dentry);
+}
+
+void fat_set_dir_index_cache_size(size_t bytes) {
+    dir_index_cache_size.store(bytes);
+}
+
+void DirIndexCache::configure(size_t capacity) {
+    indexes.capacity = capacity;
+}
+
+DirIndexCache::Value DirIndexCache::find(uint32_t cluster) {
+    Value index;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        index = indexes.find(cluster);
+    }
+    if(index){
+        hits++;
+    } else {
+        misses++;
+    }
+    return index;
+}
+
+void DirIndexCache::insert(uint32_t cluster, const Value &index) {
+    size_t bytes = sizeof(DirIndex) + index->entries.size() * dir_index_entry_bytes;
+    std::lock_guard<std::mutex> lock(mutex);
+    indexes.insert(cluster, index, bytes);
+}
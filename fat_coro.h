@@ -0,0 +1,284 @@
+#ifndef FAT_CORO_H_
+#define FAT_CORO_H_
+#include <poll.h>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "fat.h"
+
+/* C++20 coroutine versions of fat_pread() and fat_readdir(), e.g.
+ *
+ *     FatTask<int> copy_header(FatAsyncVolume &vol, int fd, char *buffer) {
+ *         int n = co_await vol.pread(fd, buffer, 512, 0);
+ *         co_return n;
+ *     }
+ *
+ *     FatExecutor executor;
+ *     FatAsyncVolume vol(executor, fat_volume_mount("disk.raw"));
+ *     int n = executor.block_on(copy_header(vol, fd, buffer));
+ *
+ * A FatExecutor runs coroutines on the thread that calls run() or block_on(). A suspended
+ * pread is one fat_volume_pread_async() call, and the executor sleeps on the volumes'
+ * eventfds until one completes, so any number of reads can be in flight from one thread.
+ */
+
+template <typename T>
+class FatTask;
+
+namespace fat_coro_detail {
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation;   // resumed when the task finishes, if any
+    std::exception_ptr exception;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            std::coroutine_handle<> continuation = handle.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { exception = std::current_exception(); }
+    void rethrow() {
+        if(exception){
+            std::rethrow_exception(exception);
+        }
+    }
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+    std::optional<T> value;
+
+    FatTask<T> get_return_object();
+    void return_value(T v) { value = std::move(v); }
+    T result() {
+        rethrow();
+        return std::move(*value);
+    }
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+    FatTask<void> get_return_object();
+    void return_void() {}
+    void result() { rethrow(); }
+};
+
+}  // namespace fat_coro_detail
+
+/* A coroutine producing a T. It starts when it is first awaited or handed to a
+ * FatExecutor, and is destroyed along with the FatTask.
+ */
+template <typename T>
+class FatTask {
+public:
+    typedef fat_coro_detail::Promise<T> promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    explicit FatTask(Handle handle): handle(handle) {}
+    FatTask(FatTask &&other) noexcept: handle(std::exchange(other.handle, nullptr)) {}
+    FatTask &operator=(FatTask &&other) noexcept {
+        if(this != &other){
+            if(handle){
+                handle.destroy();
+            }
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+    FatTask(const FatTask &) = delete;
+    FatTask &operator=(const FatTask &) = delete;
+    ~FatTask() {
+        if(handle){
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return !handle || handle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume() { return handle.promise().result(); }
+
+    bool done() const { return !handle || handle.done(); }
+
+private:
+    friend class FatExecutor;
+    Handle handle;
+};
+
+template <typename T>
+FatTask<T> fat_coro_detail::Promise<T>::get_return_object() {
+    return FatTask<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline FatTask<void> fat_coro_detail::Promise<void>::get_return_object() {
+    return FatTask<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+/* Runs coroutines on one thread. Not thread safe: every coroutine using an executor, and
+ * the volumes attached to it, must run on the thread that drives it.
+ */
+class FatExecutor {
+public:
+    FatExecutor() {}
+    FatExecutor(const FatExecutor &) = delete;
+    FatExecutor &operator=(const FatExecutor &) = delete;
+
+    // Starts task in the background; run() or block_on() drive it to completion
+    void spawn(FatTask<void> task) {
+        ready.push_back(task.handle);
+        spawned.push_back(std::move(task));
+    }
+
+    // Runs until every spawned task has finished
+    void run() {
+        while(step([this] { return all_spawned_done(); })){
+        }
+        spawned.clear();
+    }
+
+    // Runs task, and anything spawned meanwhile, until task finishes, and returns its result
+    template <typename T>
+    T block_on(FatTask<T> task) {
+        ready.push_back(task.handle);
+        while(step([&task] { return task.done(); })){
+        }
+        if(!task.done()){
+            throw std::logic_error("FatExecutor::block_on: the task is waiting for something other than a read");
+        }
+        return task.await_resume();
+    }
+
+    // Queues handle to be resumed by the executor
+    void schedule(std::coroutine_handle<> handle) { ready.push_back(handle); }
+
+    void attach(FatVolume *vol) { volumes.push_back(vol); }
+    void detach(FatVolume *vol) { std::erase(volumes, vol); }
+    void read_started() { in_flight++; }
+    void read_finished() { in_flight--; }
+
+private:
+    // Resumes what is ready, or waits for reads to complete. Returns false once finished()
+    // holds, or when nothing can make progress.
+    template <typename Finished>
+    bool step(Finished finished) {
+        while(!ready.empty()){
+            std::coroutine_handle<> handle = ready.front();
+            ready.pop_front();
+            handle.resume();
+        }
+        if(finished()){
+            return false;
+        }
+        if(in_flight == 0){
+            // suspended on something other than a read, which can't complete
+            return false;
+        }
+        int ran = 0;
+        for(FatVolume *vol : volumes){
+            ran += fat_volume_poll(vol);
+        }
+        if(ran == 0){
+            wait_for_completions();
+        }
+        return true;
+    }
+
+    void wait_for_completions() {
+        std::vector<struct pollfd> fds;
+        for(FatVolume *vol : volumes){
+            int fd = fat_volume_event_fd(vol);
+            if(fd >= 0){
+                fds.push_back({fd, POLLIN, 0});
+            }
+        }
+        if(!fds.empty()){
+            poll(fds.data(), fds.size(), -1);
+        }
+    }
+
+    bool all_spawned_done() const {
+        for(const FatTask<void> &task : spawned){
+            if(!task.done()){
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::deque<std::coroutine_handle<>> ready;
+    std::vector<FatTask<void>> spawned;
+    std::vector<FatVolume *> volumes;
+    int in_flight = 0;              // reads whose completion hasn't been polled yet
+};
+
+/* A mounted volume whose reads are awaited from coroutines run by executor. It doesn't
+ * own vol.
+ */
+class FatAsyncVolume {
+public:
+    FatAsyncVolume(FatExecutor &executor, FatVolume *vol): executor(executor), vol(vol) {
+        executor.attach(vol);
+    }
+    ~FatAsyncVolume() { executor.detach(vol); }
+    FatAsyncVolume(const FatAsyncVolume &) = delete;
+    FatAsyncVolume &operator=(const FatAsyncVolume &) = delete;
+
+    FatVolume *volume() const { return vol; }
+
+    int open(const std::string &path) { return fat_volume_open(vol, path); }
+    bool close(int fd) { return fat_volume_close(vol, fd); }
+
+    // co_await vol.pread(...) gives what fat_volume_pread() would return
+    struct PreadAwaiter {
+        FatAsyncVolume &owner;
+        int fd;
+        void *buffer;
+        int count;
+        int offset;
+        int result = -1;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> awaiting) {
+            FatExecutor &executor = owner.executor;
+            executor.read_started();
+            fat_volume_pread_async(owner.vol, fd, buffer, count, offset, [this, &executor, awaiting](int n) {
+                // runs from fat_volume_poll() on the executor's thread
+                result = n;
+                executor.read_finished();
+                executor.schedule(awaiting);
+            });
+        }
+        int await_resume() const noexcept { return result; }
+    };
+
+    PreadAwaiter pread(int fd, void *buffer, int count, int offset) {
+        return PreadAwaiter{*this, fd, buffer, count, offset};
+    }
+
+    // co_await vol.readdir(path) gives what fat_volume_readdir() would return. Directories
+    // are read through the volume's caches, so this completes without suspending.
+    FatTask<std::vector<AnyDirEntry>> readdir(std::string path) {
+        co_return fat_volume_readdir(vol, path);
+    }
+
+private:
+    FatExecutor &executor;
+    FatVolume *vol;
+};
+
+#endif
@@ -0,0 +1,256 @@
+#include "fat_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+// Files are read and written in pieces of at most this many bytes
+const uint32_t extract_chunk_size = 1024 * 1024;
+
+// The reader waits once this many bytes are read but not yet written
+const size_t max_extract_buffered = 64 * 1024 * 1024;
+
+/* A file being extracted */
+struct ExtractFile {
+    std::string host_path;
+    uint32_t first_cluster;
+    uint32_t size;
+    time_t modified;
+    std::once_flag opened;
+    int fd = -1;                        // set by the first writer to reach the file
+    std::atomic<uint32_t> remaining;    // bytes not yet handed to a writer
+};
+
+/* Part of a file, read and waiting to be written. A failed chunk stands for the rest of a
+ * file that could not be read.
+ */
+struct ExtractChunk {
+    ExtractFile *file;
+    uint32_t offset;
+    uint32_t length;
+    std::vector<char> data;
+    bool failed;
+};
+
+/* Reads files in the order of their first clusters on this thread, so the image is read
+ * mostly front to back, while writer threads put the chunks already read into host files.
+ */
+class ExtractPipeline {
+public:
+    ExtractPipeline(const FatVolume &vol, unsigned writers): vol(vol), writers(writers) {}
+
+    bool run(const std::vector<std::unique_ptr<ExtractFile>> &files) {
+        std::vector<std::thread> threads;
+        for(unsigned i = 0; i < writers; i++){
+            threads.emplace_back(&ExtractPipeline::write_chunks, this);
+        }
+        read_files(files);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            reading_done = true;
+        }
+        has_chunk.notify_all();
+        for(std::thread &thread : threads){
+            thread.join();
+        }
+        return ok;
+    }
+
+private:
+    void read_files(const std::vector<std::unique_ptr<ExtractFile>> &files) {
+        for(const std::unique_ptr<ExtractFile> &file : files){
+            if(file->size == 0){
+                put(ExtractChunk{file.get(), 0, 0, {}, false});
+                continue;
+            }
+            std::vector<Extent> extents = get_extents_from_fat(vol, file->first_cluster);
+            for(uint32_t offset = 0; offset < file->size; offset += extract_chunk_size){
+                uint32_t length = std::min(extract_chunk_size, file->size - offset);
+                std::vector<char> data(length);
+                if(!read_file_data(vol, extents, data.data(), length, offset)){
+                    FAT_TRACE(FAT_TRACE_ERROR, "could not read the data of " << file->host_path);
+                    put(ExtractChunk{file.get(), offset, file->size - offset, {}, true});
+                    break;
+                }
+                put(ExtractChunk{file.get(), offset, length, std::move(data), false});
+            }
+        }
+    }
+
+    void put(ExtractChunk chunk) {
+        std::unique_lock<std::mutex> lock(mutex);
+        has_space.wait(lock, [this, &chunk] { return buffered == 0 || buffered + chunk.data.size() <= max_extract_buffered; });
+        buffered += chunk.data.size();
+        chunks.push_back(std::move(chunk));
+        lock.unlock();
+        has_chunk.notify_one();
+    }
+
+    bool take(ExtractChunk &chunk) {
+        std::unique_lock<std::mutex> lock(mutex);
+        has_chunk.wait(lock, [this] { return !chunks.empty() || reading_done; });
+        if(chunks.empty()){
+            return false;
+        }
+        chunk = std::move(chunks.front());
+        chunks.pop_front();
+        return true;
+    }
+
+    void write_chunks() {
+        ExtractChunk chunk;
+        while(take(chunk)){
+            ExtractFile &file = *chunk.file;
+            std::call_once(file.opened, [&file] {
+                file.fd = open(file.host_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if(file.fd < 0){
+                    FAT_TRACE(FAT_TRACE_ERROR, "could not create " << file.host_path << ": " << strerror(errno));
+                }
+            });
+            if(chunk.failed || file.fd < 0 || !write_chunk(file.fd, chunk)){
+                ok = false;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                buffered -= chunk.data.size();
+            }
+            has_space.notify_one();
+            chunk.data = std::vector<char>();
+            if(file.remaining.fetch_sub(chunk.length) == chunk.length && file.fd >= 0){
+                // the last piece of the file
+                struct timespec times[2] = { { file.modified, 0 }, { file.modified, 0 } };
+                if(file.modified != 0){
+                    futimens(file.fd, times);
+                }
+                close(file.fd);
+            }
+        }
+    }
+
+    static bool write_chunk(int fd, const ExtractChunk &chunk) {
+        const char *data = chunk.data.data();
+        size_t length = chunk.data.size();
+        off_t offset = chunk.offset;
+        while(length > 0){
+            ssize_t n = pwrite(fd, data, length, offset);
+            if(n < 0 && errno == EINTR){
+                continue;
+            }
+            if(n <= 0){
+                FAT_TRACE(FAT_TRACE_ERROR, "could not write to a host file: " << strerror(errno));
+                return false;
+            }
+            data += n;
+            length -= n;
+            offset += n;
+        }
+        return true;
+    }
+
+    const FatVolume &vol;
+    unsigned writers;
+    std::mutex mutex;                   // guards everything below
+    std::condition_variable has_space;  // signalled when buffered drops
+    std::condition_variable has_chunk;  // signalled when chunks grows or reading is done
+    std::deque<ExtractChunk> chunks;
+    size_t buffered = 0;                // bytes of data in chunks or being written
+    bool reading_done = false;
+    std::atomic<bool> ok{true};
+};
+
+// Returns false if a walked path, relative to the walk's root, could leave the host
+// directory, which only a damaged image produces
+bool safe_relative_path(const std::string &path) {
+    std::stringstream components(path);
+    std::string component;
+    std::getline(components, component, '/');    // empty, before the leading /
+    while(std::getline(components, component, '/')){
+        if(component.empty() || component == "." || component == ".."){
+            return false;
+        }
+    }
+    return true;
+}
+
+bool make_host_dir(const std::string &path) {
+    if(mkdir(path.c_str(), 0755) < 0 && errno != EEXIST){
+        FAT_TRACE(FAT_TRACE_ERROR, "could not create " << path << ": " << strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool extract_tree(const FatVolume &vol, const std::string &path, const std::string &host_dir, unsigned threads,
+                  FatExtractStats &stats) {
+    if(threads == 0){
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::mutex found_mutex;
+    std::vector<FatFileInfo> found;
+    bool ok = walk_tree(vol, path, [&](const FatFileInfo &info) {
+        std::lock_guard<std::mutex> lock(found_mutex);
+        found.push_back(info);
+    }, threads);
+    if(!ok && found.empty()){
+        return false;
+    }
+    if(!make_host_dir(host_dir)){
+        return false;
+    }
+    std::string prefix = path;
+    prefix.erase(prefix.find_last_not_of('/') + 1);
+    // parents sort before their children, so directories can be created in order
+    std::sort(found.begin(), found.end(), [](const FatFileInfo &a, const FatFileInfo &b) { return a.path < b.path; });
+    std::vector<std::unique_ptr<ExtractFile>> files;
+    for(const FatFileInfo &info : found){
+        std::string relative = info.path.substr(prefix.size());
+        if(!safe_relative_path(relative)){
+            FAT_TRACE(FAT_TRACE_WARN, "not extracting " << info.path << ", which would leave " << host_dir);
+            ok = false;
+            continue;
+        }
+        std::string host_path = host_dir + relative;
+        if(info.attributes & DirEntryAttributes::DIRECTORY){
+            ok = make_host_dir(host_path) && ok;
+            stats.directories++;
+            continue;
+        }
+        std::unique_ptr<ExtractFile> file = std::make_unique<ExtractFile>();
+        file->host_path = host_path;
+        file->first_cluster = info.first_cluster;
+        file->size = info.size;
+        file->modified = info.modified;
+        file->remaining = info.size;
+        files.push_back(std::move(file));
+        stats.files++;
+        stats.bytes += info.size;
+    }
+    // read the image in the order the files sit in it
+    std::stable_sort(files.begin(), files.end(), [](const std::unique_ptr<ExtractFile> &a, const std::unique_ptr<ExtractFile> &b) {
+        return a->first_cluster < b->first_cluster;
+    });
+    ExtractPipeline pipeline(vol, threads);
+    return pipeline.run(files) && ok;
+}
+
+bool fat_volume_extract(FatVolume *vol, const std::string &path, const std::string &host_dir, unsigned threads,
+                        FatExtractStats *stats) {
+    FatExtractStats counted;
+    bool ok = false;
+    if(vol == nullptr){
+        FAT_TRACE(FAT_TRACE_WARN, "no file has been mounted");
+    } else {
+        ok = extract_tree(*vol, path, host_dir, threads, counted);
+    }
+    if(stats != nullptr){
+        *stats = counted;
+    }
+    return ok;
+}
+
+bool fat_extract(const std::string &path, const std::string &host_dir, unsigned threads, FatExtractStats *stats) {
+    return fat_volume_extract(mounted_volume, path, host_dir, threads, stats);
+}
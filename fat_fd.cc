@@ -0,0 +1,148 @@
+#include "fat_internal.h"
+
+// Layout of Slot::state
+const uint64_t slot_references = 0xFFFFFFFFULL;
+const uint64_t slot_open = 1ULL << 32;
+const int slot_generation_shift = 33;
+// generations wrap at this mask so every descriptor is a non-negative int
+const uint64_t slot_generation_mask = (1ULL << (31 - FdTable::slot_bits)) - 1;
+
+FdTable::Ref::~Ref() {
+    if(table != nullptr){
+        table->release(index);
+    }
+}
+
+FDEntry *FdTable::Ref::operator->() const {
+    return &table->slot(index)->entry;
+}
+
+FdTable::~FdTable() {
+    clear();
+}
+
+FdTable::Slot *FdTable::slot(uint32_t index) const {
+    Slot *chunk = chunks[index / chunk_size].load(std::memory_order_acquire);
+    return chunk == nullptr ? nullptr : &chunk[index % chunk_size];
+}
+
+bool FdTable::pop_free(uint32_t &index) {
+    uint64_t head = free_head.load(std::memory_order_acquire);
+    while((uint32_t) head != 0){
+        index = (uint32_t) head - 1;
+        // may be stale if another thread pops this slot first, but then the tag has moved on
+        uint32_t next = slot(index)->next_free.load(std::memory_order_relaxed);
+        uint64_t popped = (((head >> 32) + 1) << 32) | next;
+        if(free_head.compare_exchange_weak(head, popped, std::memory_order_acquire, std::memory_order_acquire)){
+            return true;
+        }
+    }
+    return false;
+}
+
+bool FdTable::add_slot(uint32_t &index) {
+    uint32_t used = slots_used.load();
+    do {
+        if(used == max_slots){
+            return false;
+        }
+    } while(!slots_used.compare_exchange_weak(used, used + 1));
+    index = used;
+    std::atomic<Slot *> &chunk = chunks[index / chunk_size];
+    if(chunk.load(std::memory_order_acquire) == nullptr){
+        // threads racing to allocate the same chunk keep whichever is installed first
+        Slot *fresh = new Slot[chunk_size];
+        Slot *expected = nullptr;
+        if(!chunk.compare_exchange_strong(expected, fresh, std::memory_order_acq_rel)){
+            delete[] fresh;
+        }
+    }
+    return true;
+}
+
+int FdTable::open(const DirEntry &dir, std::shared_ptr<Readahead> readahead) {
+    uint32_t index;
+    if(!pop_free(index) && !add_slot(index)){
+        return -1;
+    }
+    // nobody else can touch a slot that is neither open nor on the free stack
+    Slot &s = *slot(index);
+    s.entry.dir = dir;
+    s.entry.readahead = std::move(readahead);
+    uint64_t generation = s.state.load(std::memory_order_relaxed) >> slot_generation_shift;
+    s.state.store((generation << slot_generation_shift) | slot_open, std::memory_order_release);
+    return (int) ((generation << slot_bits) | index);
+}
+
+FdTable::Ref FdTable::acquire(int fd) {
+    if(fd < 0){
+        return Ref();
+    }
+    uint32_t index = fd & (max_slots - 1);
+    uint64_t generation = (uint32_t) fd >> slot_bits;
+    Slot *s = slot(index);
+    if(s == nullptr){
+        return Ref();
+    }
+    uint64_t state = s->state.load(std::memory_order_acquire);
+    while((state & slot_open) && (state >> slot_generation_shift) == generation){
+        if(s->state.compare_exchange_weak(state, state + 1, std::memory_order_acquire)){
+            return Ref(this, index);
+        }
+    }
+    return Ref();
+}
+
+bool FdTable::close(int fd) {
+    if(fd < 0){
+        return false;
+    }
+    uint32_t index = fd & (max_slots - 1);
+    uint64_t generation = (uint32_t) fd >> slot_bits;
+    Slot *s = slot(index);
+    if(s == nullptr){
+        return false;
+    }
+    uint64_t state = s->state.load(std::memory_order_acquire);
+    while((state & slot_open) && (state >> slot_generation_shift) == generation){
+        if(s->state.compare_exchange_weak(state, state & ~slot_open, std::memory_order_acq_rel)){
+            if((state & slot_references) == 0){
+                recycle(index, state & ~slot_open);
+            }
+            // otherwise the last reader to release the slot recycles it
+            return true;
+        }
+    }
+    return false;
+}
+
+void FdTable::release(uint32_t index) {
+    Slot &s = *slot(index);
+    uint64_t state = s.state.fetch_sub(1, std::memory_order_acq_rel) - 1;
+    if((state & slot_references) == 0 && !(state & slot_open)){
+        recycle(index, state);
+    }
+}
+
+void FdTable::recycle(uint32_t index, uint64_t state) {
+    Slot &s = *slot(index);
+    s.entry.extents.store(nullptr);
+    // may wait for a readahead window still being read
+    s.entry.readahead.reset();
+    uint64_t generation = ((state >> slot_generation_shift) + 1) & slot_generation_mask;
+    s.state.store(generation << slot_generation_shift, std::memory_order_relaxed);
+    uint64_t head = free_head.load(std::memory_order_relaxed);
+    uint64_t pushed;
+    do {
+        s.next_free.store((uint32_t) head, std::memory_order_relaxed);
+        pushed = (((head >> 32) + 1) << 32) | (index + 1);
+    } while(!free_head.compare_exchange_weak(head, pushed, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void FdTable::clear() {
+    for(std::atomic<Slot *> &chunk : chunks){
+        delete[] chunk.exchange(nullptr);
+    }
+    slots_used = 0;
+    free_head = 0;
+}
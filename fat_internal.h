@@ -1,8 +1,37 @@
 #ifndef FAT_INTERNAL_H_
 #define FAT_INTERNAL_H_
-#include <fstream>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <utility>
 #include "fat.h"
 
+#ifndef FAT_TRACE_MAX_LEVEL
+#define FAT_TRACE_MAX_LEVEL FAT_TRACE_DEBUG
+#endif
+
+/* Emits a trace message built with stream syntax, e.g. FAT_TRACE(FAT_TRACE_INFO, "no " << name).
+ * The message is only formatted when its level is enabled, and compiles to nothing when
+ * the level is above FAT_TRACE_MAX_LEVEL.
+ */
+#define FAT_TRACE(level, msg) \
+    do { \
+        if ((level) <= FAT_TRACE_MAX_LEVEL && (level) <= trace_level.load(std::memory_order_relaxed)) { \
+            std::ostringstream fat_trace_ss; \
+            fat_trace_ss << msg; \
+            trace_emit((level), fat_trace_ss.str()); \
+        } \
+    } while (0)
+
 /*
  * On a little-endian machine, this struct duplicates the on-disk layout of the FAT32
  * Boot Sector and Bios Parameter Block (BPB), described in pages 7-13 of the FAT specification.
@@ -41,22 +70,473 @@ struct __attribute__((packed)) Fat32BPB {
     uint8_t BS_FileSysTye[8];       // FAT12, FAT16 etc
 };
 
+/* Memory shared by every mounted volume for FAT tables and caches. charge() fails instead
+ * of going over the limit, so the caller can evict something or give up.
+ */
+struct MemoryBudget {
+    std::atomic<size_t> limit;
+    std::atomic<size_t> used;
+
+    MemoryBudget(): limit(SIZE_MAX), used(0) {}
+    bool charge(size_t bytes);
+    void release(size_t bytes);
+};
+
+extern MemoryBudget memory_budget;
+
+/* An LRU map from a key such as a cluster number to a shared, immutable value. Each value
+ * costs value_bytes bytes unless insert() is told otherwise. It holds at most capacity bytes
+ * of values, charges them to memory_budget, and does no locking of its own.
+ */
+template <typename K, typename T>
+struct LruMap {
+    typedef std::shared_ptr<const T> Value;
+
+    struct Slot {
+        Value value;
+        typename std::list<K>::iterator lru_pos;
+        size_t bytes;
+    };
+
+    size_t capacity = 0;        // bytes
+    size_t value_bytes = 0;     // default cost of one value
+    size_t charged = 0;         // bytes of memory_budget held by the values
+    std::unordered_map<K, Slot> values;
+    std::list<K> lru;           // keys, most recently used first
+
+    LruMap() {}
+    ~LruMap() { memory_budget.release(charged); }
+    LruMap(const LruMap &) = delete;
+    LruMap &operator=(const LruMap &) = delete;
+
+    // Returns the value for key and marks it most recently used, or nullptr
+    Value find(const K &key) {
+        auto it = values.find(key);
+        if(it == values.end()){
+            return nullptr;
+        }
+        lru.splice(lru.begin(), lru, it->second.lru_pos);
+        return it->second.value;
+    }
+
+    bool insert(const K &key, const Value &value) {
+        return insert(key, value, value_bytes);
+    }
+
+    // Caches value, which costs bytes, under key, evicting older values to make room. Returns
+    // false if it was not cached, because it doesn't fit or the budget is held by others.
+    bool insert(const K &key, const Value &value, size_t bytes) {
+        if(bytes > capacity || values.count(key) != 0){
+            return false;
+        }
+        while(charged + bytes > capacity){
+            evict_lru();
+        }
+        while(!memory_budget.charge(bytes)){
+            if(lru.empty()){
+                return false;
+            }
+            evict_lru();
+        }
+        charged += bytes;
+        lru.push_front(key);
+        values.emplace(key, Slot{value, lru.begin(), bytes});
+        return true;
+    }
+
+    void evict_lru() {
+        auto it = values.find(lru.back());
+        memory_budget.release(it->second.bytes);
+        charged -= it->second.bytes;
+        values.erase(it);
+        lru.pop_back();
+    }
+};
+
+struct FatVolume;
+
+const uint32_t fat_page_entries = 1024;     // FAT entries per page, so 4 KiB pages
+
+/* A volume's FAT, read from the image in fixed-size pages the first time they are needed
+ * and kept in an LRU map. When the image is mapped, pages point straight into the mapping
+ * and nothing is cached. Pages are handed out as shared_ptrs, so a page that is evicted
+ * stays valid for a walk that is still using it.
+ */
+struct FatTable {
+    typedef LruMap<uint32_t, uint32_t>::Value Page;
+
+    const char *map = nullptr;  // the FAT inside the image mapping, or nullptr
+    uint64_t offset = 0;        // byte offset of the FAT within the image
+    uint32_t size = 0;          // size of the FAT in bytes
+
+    std::mutex mutex;           // guards pages
+    LruMap<uint32_t, uint32_t> pages;
+
+    // Returns page page_no of the FAT, reading it if needed. nullptr if it can't be read.
+    Page page(const FatVolume &vol, uint32_t page_no);
+};
+
+const int block_cache_shards = 16;
+
+/* Recently read clusters of a volume, keyed by cluster number. Directory scans go through
+ * it so hot directories such as the root are served from memory. It is split into shards
+ * with their own lock and LRU list, so threads looking up different clusters rarely
+ * contend.
+ */
+struct BlockCache {
+    typedef LruMap<uint32_t, char>::Value Block;
+
+    struct Shard {
+        std::mutex mutex;
+        LruMap<uint32_t, char> blocks;
+    };
+    Shard shards[block_cache_shards];
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+
+    // Sizes the cache for clusters of block_size bytes, using at most capacity bytes
+    void configure(size_t block_size, size_t capacity);
+    // Fetches count physically contiguous clusters starting at cluster into blocks, one per
+    // cluster, reading each run of missing clusters with a single call.
+    bool fetch(const FatVolume &vol, uint32_t cluster, uint32_t count, std::vector<Block> &blocks);
+};
+
+/* The outcome of looking up one path, including lookups that found nothing */
+struct Dentry {
+    bool found;
+    DirEntry entry;
+};
+
+/* Resolved paths, keyed by the normalized path (a '/' and the ShortName of each name), so repeated opens of the same path cost one
+ * hash lookup. Sharded like BlockCache.
+ */
+struct DentryCache {
+    typedef LruMap<std::string, Dentry>::Value Value;
+
+    struct Shard {
+        std::mutex mutex;
+        LruMap<std::string, Dentry> dentries;
+    };
+    Shard shards[block_cache_shards];
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+
+    void configure(size_t capacity);    // capacity in bytes
+    Value find(const std::string &path);
+    void insert(const std::string &path, const Value &dentry);
+};
+
+/* A name in the 11-byte form of DIR_Name: upper case, with the base name and extension
+ * each padded with spaces, e.g. "FOO     TXT".
+ */
+typedef std::array<char, 11> ShortName;
+
+struct ShortNameHash {
+    size_t operator()(const ShortName &name) const {
+        // FNV-1a
+        uint64_t hash = 14695981039346656037ULL;
+        for(char c : name){
+            hash = (hash ^ (unsigned char) c) * 1099511628211ULL;
+        }
+        return hash;
+    }
+};
+
+/* Which of up to 64 consecutive directory entries are of each kind, one bit per entry.
+ * Every entry is exactly one kind.
+ */
+struct DirEntryMasks {
+    uint64_t free = 0;          // first byte 0x00, nothing follows in this cluster
+    uint64_t deleted = 0;       // first byte 0xE5
+    uint64_t long_name = 0;     // a piece of a long name
+    uint64_t volume_label = 0;
+    uint64_t live = 0;          // files and directories
+};
+
+/* Classifies count <= 64 directory entries. Uses AVX2 or SSE2 when the CPU has them;
+ * setting FAT_SCAN_ISA to "sse2" or "scalar" in the environment forces a narrower one.
+ */
+void scan_dir_entries(const char *entries, uint32_t count, DirEntryMasks &masks);
+/* Returns a bit for each of count <= 64 entries whose DIR_Name, upper-cased, is name */
+uint64_t match_dir_entries(const char *entries, uint32_t count, const ShortName &name);
+/* Given the count FAT entries of clusters cluster, cluster + 1, ..., returns how many of them
+ * in a row link to the cluster right after their own, i.e. the length of the contiguous run.
+ */
+uint32_t fat_run_length(const uint32_t *entries, uint32_t cluster, uint32_t count);
+
+/* The entries of one directory, keyed by their upper-cased DIR_Name. Built by reading the
+ * whole directory once. Only live entries are indexed, so deleted entries, long name
+ * pieces and the volume label can't be opened.
+ */
+struct DirIndex {
+    std::unordered_map<ShortName, DirEntry, ShortNameHash> entries;
+};
+
+/* Name indexes of directories that have been searched, keyed by the directory's first
+ * cluster, so looking up another name in a large directory doesn't scan it again. Each
+ * index is charged for its entries. It isn't sharded like BlockCache, because one index
+ * of a large directory can take megabytes, and it is only consulted when DentryCache
+ * misses.
+ */
+struct DirIndexCache {
+    typedef LruMap<uint32_t, DirIndex>::Value Value;
+
+    std::mutex mutex;           // guards indexes
+    LruMap<uint32_t, DirIndex> indexes;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+
+    void configure(size_t capacity);    // capacity in bytes
+    bool enabled() const { return indexes.capacity != 0; }
+    Value find(uint32_t cluster);
+    void insert(uint32_t cluster, const Value &index);
+};
+
+const uint32_t readahead_initial_window = 128 * 1024;
+
+/* Sequential readahead state of one open file. Once a read starts where the previous one
+ * ended, the data after it is read in windows on other threads, so later reads are copied
+ * out of memory. Two windows are kept ahead of the reader, and each new one is twice the
+ * size of the last, up to the volume's readahead_size. Any other read drops them.
+ */
+struct Readahead {
+    typedef std::shared_ptr<const std::vector<char>> Data;
+
+    struct Window {
+        uint64_t offset;        // in the file
+        uint32_t length;
+        std::shared_future<Data> data;  // empty if the window could not be read
+    };
+
+    std::mutex mutex;           // guards everything below
+    uint64_t next_offset = 0;   // where a sequential read would start
+    uint32_t window_size = 0;   // size of the next window, 0 when not reading sequentially
+    std::deque<Window> windows; // sorted and contiguous, charged to memory_budget
+
+    Readahead() {}
+    ~Readahead();
+    Readahead(const Readahead &) = delete;
+    Readahead &operator=(const Readahead &) = delete;
+};
+
+/* An open file: the directory entry it was opened from and state shared by its reads */
+struct FDEntry {
+    DirEntry dir;
+    // the file's cluster chain sorted by file_cluster, built lazily on the first read and
+    // shared with reads that are in progress
+    std::atomic<std::shared_ptr<const std::vector<Extent>>> extents;
+    std::shared_ptr<Readahead> readahead;   // sequential read detection and prefetched data
+};
+
+/* The file descriptors of a volume, safe to use from any number of threads without locks.
+ * A descriptor is (generation << slot_bits) | slot. Slots live in chunks that are allocated
+ * as the table grows and never move, and free slots are kept on a stack whose head carries
+ * a tag against ABA. A slot's generation is bumped each time it is recycled, so a stale
+ * descriptor is rejected rather than reaching the file that reuses its slot. Readers pin a
+ * slot with a reference count while they copy out of it; closing clears the slot's open
+ * bit, and whoever drops the last reference puts the slot back on the free stack.
+ */
+class FdTable {
+    struct Slot {
+        std::atomic<uint64_t> state{0};     // generation << 33 | open << 32 | references
+        std::atomic<uint32_t> next_free{0}; // slot + 1 below this one on the free stack, 0 at the bottom
+        FDEntry entry;
+    };
+
+public:
+    static const int slot_bits = 20;            // so up to a million files can be open
+    static const uint32_t chunk_size = 1024;    // slots allocated at once
+
+    /* A pinned open file; the slot can't be recycled while this exists */
+    class Ref {
+    public:
+        Ref() {}
+        Ref(Ref &&other) noexcept: table(std::exchange(other.table, nullptr)), index(other.index) {}
+        Ref(const Ref &) = delete;
+        Ref &operator=(const Ref &) = delete;
+        ~Ref();
+
+        explicit operator bool() const { return table != nullptr; }
+        FDEntry *operator->() const;
+
+    private:
+        friend class FdTable;
+        Ref(FdTable *table, uint32_t index): table(table), index(index) {}
+        FdTable *table = nullptr;
+        uint32_t index = 0;
+    };
+
+    FdTable() {}
+    ~FdTable();
+    FdTable(const FdTable &) = delete;
+    FdTable &operator=(const FdTable &) = delete;
+
+    // Returns a new descriptor for dir, or -1 if the table is full
+    int open(const DirEntry &dir, std::shared_ptr<Readahead> readahead);
+    // Returns false if fd isn't open
+    bool close(int fd);
+    // Pins fd's entry; the Ref is empty if fd isn't open
+    Ref acquire(int fd);
+    // Frees every slot. Only for when no other thread can be using the table.
+    void clear();
+
+private:
+    static const uint32_t max_slots = 1u << slot_bits;
+    static const uint32_t max_chunks = max_slots / chunk_size;
+
+    Slot *slot(uint32_t index) const;   // nullptr if its chunk hasn't been allocated
+    bool pop_free(uint32_t &index);
+    bool add_slot(uint32_t &index);
+    void release(uint32_t index);
+    void recycle(uint32_t index, uint64_t state);
+
+    std::atomic<Slot *> chunks[max_chunks] = {};
+    std::atomic<uint32_t> slots_used{0};    // slots handed out so far, open or free
+    std::atomic<uint64_t> free_head{0};     // tag << 32 | (slot + 1) of the free stack's top
+};
+
+/* Where a FatDirStream is in its directory. Clusters are fetched in the same runs as
+ * other directory reads, and the storage for a run is reused for the next one.
+ */
+struct FatDirStream::State {
+    const FatVolume *vol = nullptr;
+    bool ok = true;
+    bool started = false;
+    std::vector<Extent> extents;    // the directory's cluster chain, mapped on the first read
+    size_t extent = 0;              // next run to fetch starts at run_index in extents[extent]
+    uint32_t run_index = 0;
+    std::vector<BlockCache::Block> blocks;  // pins the clusters of the run being listed
+    std::vector<const char *> clusters;     // contents of each cluster of that run
+    size_t next_cluster = 0;        // index into clusters of the one after cluster
+    const char *cluster = nullptr;  // cluster being listed, or nullptr between clusters
+    uint32_t entry = 0;             // index of the next entry of cluster to yield
+};
+
+/* One read from the image */
+struct IoRead {
+    char *buffer;
+    uint32_t length;
+    uint64_t offset;
+};
+
+/* Reads from an image file descriptor on behalf of a volume. submit() starts a batch of
+ * reads and returns; done is called once all of them have finished, with false if any
+ * failed or ran past the end of the image. It may be called on another thread, or on the
+ * calling thread before submit() returns.
+ */
+class IoEngine {
+public:
+    virtual ~IoEngine() {}
+    virtual FatIoEngine kind() const = 0;
+    virtual void submit(const std::vector<IoRead> &reads, std::function<void(bool)> done) = 0;
+
+    // Submits reads and waits for them. Returns false if any failed.
+    bool read(const std::vector<IoRead> &reads);
+};
+
+/* How send_image_range() moves data from the image to another descriptor, in the order
+ * they are tried. Each kernel call only works for some pairs of descriptors, so a method
+ * that fails falls back to the next one, ending with pread() and write().
+ */
+enum class SendMethod { COPY_FILE_RANGE, SENDFILE, SPLICE, COPY };
+
+/* Creates an engine of the given kind reading from fd, falling back to FAT_IO_THREADS if
+ * io_uring is unavailable. Returns nullptr for FAT_IO_SYNC.
+ */
+std::unique_ptr<IoEngine> make_io_engine(FatIoEngine kind, int fd);
+
+/* The asynchronous reads of a volume: callbacks of finished reads waiting for
+ * fat_volume_poll(), and a count of reads still in flight so unmounting can wait for them.
+ */
+struct AsyncReads {
+    std::mutex mutex;               // guards everything below
+    std::condition_variable idle;   // signalled when pending drops to 0
+    std::deque<std::function<void()>> completions;
+    int pending = 0;
+    int event_fd = -1;              // created by the first get_event_fd() call
+
+    AsyncReads() {}
+    ~AsyncReads();
+    AsyncReads(const AsyncReads &) = delete;
+    AsyncReads &operator=(const AsyncReads &) = delete;
+
+    void start();
+    void finish();
+    void wait_idle();
+    void post(std::function<void()> callback);  // queues callback and signals event_fd
+    int poll();                     // runs the queued callbacks, returns how many
+    int get_event_fd();
+};
+
+/* All of the state for one mounted image. Everything except the fd table is fixed once
+ * the volume has been mounted, and the fd table takes no locks, so threads reading
+ * different files don't wait on each other to look up their descriptors. Image data is read with pread() or
+ * straight out of the mapping, so there is no shared file position between threads.
+ */
+struct FatVolume {
+    int image_fd = -1;              // image opened for pread(), -1 when it is mapped
+    std::shared_ptr<const char> image_mapping;  // unmaps the image once views release it
+    const char *image_map = nullptr;    // base of the mmap'd image, or nullptr
+    size_t image_size = 0;          // size of image_map in bytes
+
+    std::unique_ptr<IoEngine> io;   // reads file data, or nullptr to pread() directly
+    AsyncReads async;
+
+    Fat32BPB bpb;
+    uint32_t cluster_size = 0;      // bytes in a cluster
+    uint32_t root_dir_sectors = 0;  // number of sectors in the root dir
+    uint32_t first_data_sector = 0;
+    uint32_t first_fat_sector = 0;
+    uint32_t data_sec = 0;
+    uint32_t count_of_clusters = 0; // Number of clusters on the disk
+    uint32_t root_cluster_32 = 0;   // the root cluster on a 32 byte FAT
+    uint32_t dir_entry_size = 32;   // size of a directory entry in bytes
+
+    mutable FatTable fat;           // the FAT, indexed by cluster number
+    mutable BlockCache blocks;      // recently read directory clusters
+    mutable DentryCache dentries;   // recently resolved paths
+    mutable DirIndexCache dir_indexes;  // name indexes of searched directories
+
+    uint32_t readahead_size = 0;    // largest readahead window, 0 for none
+    std::atomic<uint64_t> readahead_hits{0};
+
+    FdTable fds;                    // the files opened with fat_volume_open()
+
+    FatVolume() {}
+    ~FatVolume();
+    FatVolume(const FatVolume &) = delete;
+    FatVolume &operator=(const FatVolume &) = delete;
+};
+
 // globals used
-std::ifstream infile;
-
-Fat32BPB *fatbpb;
-uint32_t cluster_size;      // bytes in a cluster
-uint32_t root_dir_sectors; // number of sectors in the root dir
-uint32_t first_data_sector;
-uint32_t first_fat_sector;
-uint32_t data_sec;
-uint32_t count_of_clusters; // Number of clusters on the disk
-uint32_t root_cluster_32;   // the root cluster on a 32 byte FAT
-uint32_t dir_entry_size;    // size of a directory entry in bytes
-
-uint32_t cur_dir_clust;     // The cluster # of the directory the user is currently inside of;
-//TODO: Make this a vector
-uint32_t *fatTable;         // array of FAT indexes that can be indexed by the cluster num
-
-std::vector<FDEntry> fdTable(128);      // array of file descriptors to be used with open, close, and read
+extern FatVolume *mounted_volume;   // the volume fat_open() and friends act on
+extern std::atomic<size_t> fat_cache_size;   // FAT cache size in bytes for new mounts
+extern std::atomic<size_t> block_cache_size; // block cache size in bytes for new mounts
+extern std::atomic<size_t> dentry_cache_size;   // dentry cache size in bytes for new mounts
+extern std::atomic<size_t> dir_index_cache_size;    // directory index cache size in bytes for new mounts
+extern std::atomic<size_t> readahead_size;  // largest readahead window in bytes for new mounts
+extern std::atomic<int> io_engine;          // FatIoEngine for new mounts
+
+extern std::atomic<int> trace_level;
+extern std::mutex trace_mutex;      // guards trace_sink and serializes messages
+extern FatTraceSink trace_sink;     // empty means write to stderr
+
+void trace_emit(FatTraceLevel level, const std::string &message);
+
+uint64_t cluster_offset(const FatVolume &vol, uint32_t cluster);
+bool read_image(const FatVolume &vol, char *dest, uint64_t offset, uint64_t count);
+const char *mapped_data(const FatVolume &vol, uint64_t offset, uint64_t length);
+uint32_t get_dir_cluster_num(const DirEntry &dir);
+bool is_root_ref(const std::string &path);
+bool resolve_path(const FatVolume &vol, const std::string &path, DirEntry &entry, uint32_t &cluster);
+std::vector<Extent> get_extents_from_fat(const FatVolume &vol, uint32_t cluster_num);
+bool read_file_data(const FatVolume &vol, const std::vector<Extent> &extents, char *buffer, uint32_t count, uint64_t offset);
+bool walk_tree(const FatVolume &vol, const std::string &path, const FatWalkCallback &visit, unsigned threads);
+// Calls visit with each live entry of the directory starting at cluster, the ones an index
+// or lookup would find. Returns false if the directory could not be read.
+bool visit_live_entries(const FatVolume &vol, uint32_t cluster, const std::function<void(const DirEntry &)> &visit);
+
+// Writes length bytes at offset of the image to out_fd, starting with method and leaving
+// it set to the method that worked so later ranges don't retry the failed ones
+bool send_image_range(const FatVolume &vol, uint64_t offset, uint64_t length, int out_fd, SendMethod &method);
 #endif
@@ -0,0 +1,521 @@
+#include "fat_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <cstring>
+#include <thread>
+
+std::atomic<int> io_engine(FAT_IO_SYNC);
+
+void fat_set_io_engine(FatIoEngine engine) {
+    io_engine.store(engine);
+}
+
+/* The reads of one submit() call still outstanding */
+struct IoBatch {
+    std::atomic<size_t> remaining;
+    std::atomic<bool> ok;
+    std::function<void(bool)> done;
+
+    IoBatch(size_t count, std::function<void(bool)> done): remaining(count), ok(true), done(std::move(done)) {}
+
+    void finish(bool read_ok) {
+        if(!read_ok){
+            ok = false;
+        }
+        if(remaining.fetch_sub(1) == 1){
+            done(ok.load());
+        }
+    }
+};
+
+bool IoEngine::read(const std::vector<IoRead> &reads) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool finished = false;
+    bool result = false;
+    submit(reads, [&](bool ok) {
+        std::lock_guard<std::mutex> lock(mutex);
+        result = ok;
+        finished = true;
+        cv.notify_one();
+    });
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return finished; });
+    return result;
+}
+
+AsyncReads::~AsyncReads() {
+    if(event_fd >= 0){
+        close(event_fd);
+    }
+}
+
+void AsyncReads::start() {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending++;
+}
+
+void AsyncReads::finish() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(--pending == 0){
+        idle.notify_all();
+    }
+}
+
+void AsyncReads::wait_idle() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return pending == 0; });
+}
+
+void AsyncReads::post(std::function<void()> callback) {
+    std::lock_guard<std::mutex> lock(mutex);
+    completions.push_back(std::move(callback));
+    if(event_fd >= 0){
+        uint64_t one = 1;
+        if(write(event_fd, &one, sizeof one) < 0){
+            FAT_TRACE(FAT_TRACE_ERROR, "could not signal the completion eventfd");
+        }
+    }
+}
+
+int AsyncReads::poll() {
+    std::deque<std::function<void()>> ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready.swap(completions);
+        if(event_fd >= 0){
+            uint64_t count;
+            // the eventfd is non-blocking, so this only fails when it was already clear
+            if(read(event_fd, &count, sizeof count) < 0 && errno != EAGAIN){
+                FAT_TRACE(FAT_TRACE_ERROR, "could not clear the completion eventfd");
+            }
+        }
+    }
+    // callbacks may start more reads, so they run without the lock
+    for(const std::function<void()> &callback : ready){
+        callback();
+    }
+    return (int) ready.size();
+}
+
+int AsyncReads::get_event_fd() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(event_fd < 0){
+        event_fd = eventfd(completions.empty() ? 0 : 1, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    return event_fd;
+}
+
+/* Reads with pread() on a fixed pool of threads */
+class ThreadPoolEngine : public IoEngine {
+public:
+    ThreadPoolEngine(int fd, int threads): fd(fd) {
+        for(int i = 0; i < threads; i++){
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    ~ThreadPoolEngine() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for(std::thread &worker : workers){
+            worker.join();
+        }
+    }
+
+    FatIoEngine kind() const { return FAT_IO_THREADS; }
+
+    void submit(const std::vector<IoRead> &reads, std::function<void(bool)> done) {
+        if(reads.empty()){
+            done(true);
+            return;
+        }
+        std::shared_ptr<IoBatch> batch = std::make_shared<IoBatch>(reads.size(), std::move(done));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for(const IoRead &read : reads){
+                queue.push_back({read, batch});
+            }
+        }
+        cv.notify_all();
+    }
+
+private:
+    struct Job {
+        IoRead read;
+        std::shared_ptr<IoBatch> batch;
+    };
+
+    void work() {
+        for(;;){
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return stopping || !queue.empty(); });
+                if(queue.empty()){
+                    return;
+                }
+                job = std::move(queue.front());
+                queue.pop_front();
+            }
+            job.batch->finish(read_fully(job.read));
+        }
+    }
+
+    bool read_fully(IoRead read) {
+        while(read.length > 0){
+            ssize_t n = pread(fd, read.buffer, read.length, read.offset);
+            if(n < 0 && errno == EINTR){
+                continue;
+            }
+            if(n <= 0){
+                return false;
+            }
+            read.buffer += n;
+            read.offset += n;
+            read.length -= n;
+        }
+        return true;
+    }
+
+    int fd;
+    std::mutex mutex;               // guards queue and stopping
+    std::condition_variable cv;
+    std::deque<Job> queue;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+/* Reads through an io_uring, talking to the kernel with raw system calls. Any thread can
+ * submit; one thread reaps completions, resubmits the rest of short reads and calls the
+ * batches' done functions.
+ */
+class UringEngine : public IoEngine {
+public:
+    // Returns nullptr if the kernel can't set up a ring
+    static std::unique_ptr<UringEngine> create(int fd, unsigned entries) {
+        std::unique_ptr<UringEngine> engine(new UringEngine(fd));
+        if(!engine->setup(entries)){
+            return nullptr;
+        }
+        engine->reaper = std::thread([e = engine.get()] { e->reap(); });
+        return engine;
+    }
+
+    ~UringEngine() {
+        if(reaper.joinable()){
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                stopping = true;
+                // a no-op without an Op wakes the reaper up so it can see stopping
+                push_sqe(IORING_OP_NOP, nullptr);
+                enter(1, 0, 0);
+            }
+            reaper.join();
+        }
+        if(sqes != MAP_FAILED){
+            munmap(sqes, sqe_map_size);
+        }
+        if(rings != MAP_FAILED){
+            munmap(rings, ring_map_size);
+        }
+        if(ring_fd >= 0){
+            close(ring_fd);
+        }
+    }
+
+    FatIoEngine kind() const { return FAT_IO_URING; }
+
+    void submit(const std::vector<IoRead> &reads, std::function<void(bool)> done) {
+        if(reads.empty()){
+            done(true);
+            return;
+        }
+        std::shared_ptr<IoBatch> batch = std::make_shared<IoBatch>(reads.size(), std::move(done));
+        std::unique_lock<std::mutex> lock(mutex);
+        unsigned pending = 0;
+        for(const IoRead &read : reads){
+            if(in_flight == cq_entries){
+                // the completion queue must never overflow, so wait for the reaper
+                enter(pending, 0, 0);
+                pending = 0;
+                space.wait(lock, [this] { return in_flight < cq_entries; });
+            }
+            Op *op = new Op{read, batch, {}};
+            push_sqe(IORING_OP_READV, op);
+            pending++;
+        }
+        enter(pending, 0, 0);
+    }
+
+private:
+    struct Op {
+        IoRead read;                // what is left to read
+        std::shared_ptr<IoBatch> batch;
+        struct iovec iov;
+    };
+
+    explicit UringEngine(int fd): fd(fd) {}
+
+    bool setup(unsigned entries) {
+        struct io_uring_params params = {};
+        ring_fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+        if(ring_fd < 0){
+            return false;
+        }
+        if(!(params.features & IORING_FEAT_SINGLE_MMAP)){
+            return false;
+        }
+        sq_entries = params.sq_entries;
+        cq_entries = params.cq_entries;
+        ring_map_size = std::max(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                                 params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+        rings = mmap(nullptr, ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if(rings == MAP_FAILED){
+            return false;
+        }
+        sqe_map_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = mmap(nullptr, sqe_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if(sqes == MAP_FAILED){
+            return false;
+        }
+        char *base = (char *) rings;
+        sq_head = (unsigned *) (base + params.sq_off.head);
+        sq_tail = (unsigned *) (base + params.sq_off.tail);
+        sq_mask = *(unsigned *) (base + params.sq_off.ring_mask);
+        sq_array = (unsigned *) (base + params.sq_off.array);
+        cq_head = (unsigned *) (base + params.cq_off.head);
+        cq_tail = (unsigned *) (base + params.cq_off.tail);
+        cq_mask = *(unsigned *) (base + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *) (base + params.cq_off.cqes);
+        return true;
+    }
+
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+        int ret;
+        do {
+            ret = (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+        } while(ret < 0 && errno == EINTR);
+        return ret;
+    }
+
+    // Queues one entry for op, which is nullptr for a wake-up no-op. Must be called with
+    // mutex held; submits what is queued if the submission queue is full.
+    void push_sqe(uint8_t opcode, Op *op) {
+        unsigned tail = *sq_tail;
+        while(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries){
+            enter(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE), 0, 0);
+        }
+        struct io_uring_sqe *sqe = &((struct io_uring_sqe *) sqes)[tail & sq_mask];
+        memset(sqe, 0, sizeof *sqe);
+        sqe->opcode = opcode;
+        sqe->fd = -1;
+        if(op != nullptr){
+            op->iov.iov_base = op->read.buffer;
+            op->iov.iov_len = op->read.length;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t) &op->iov;
+            sqe->len = 1;
+            sqe->off = op->read.offset;
+            in_flight++;
+        }
+        sqe->user_data = (uint64_t) op;
+        sq_array[tail & sq_mask] = tail & sq_mask;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    void reap() {
+        for(;;){
+            enter(0, 1, IORING_ENTER_GETEVENTS);
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            std::vector<std::pair<Op *, int>> completed;
+            for(; head != tail; head++){
+                const struct io_uring_cqe &cqe = cqes[head & cq_mask];
+                completed.push_back({(Op *) cqe.user_data, cqe.res});
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+            bool stop = false;
+            std::unique_lock<std::mutex> lock(mutex);
+            unsigned resubmit = 0;
+            std::vector<std::pair<Op *, bool>> finished;
+            for(const std::pair<Op *, int> &c : completed){
+                Op *op = c.first;
+                if(op == nullptr){
+                    stop = stopping;
+                    continue;
+                }
+                in_flight--;
+                int res = c.second;
+                if(res == -EINTR || res == -EAGAIN){
+                    push_sqe(IORING_OP_READV, op);
+                    resubmit++;
+                } else if(res <= 0){
+                    // an I/O error, or the read ran past the end of the image
+                    finished.push_back({op, false});
+                } else if((uint32_t) res < op->read.length){
+                    op->read.buffer += res;
+                    op->read.offset += res;
+                    op->read.length -= res;
+                    push_sqe(IORING_OP_READV, op);
+                    resubmit++;
+                } else {
+                    finished.push_back({op, true});
+                }
+            }
+            if(resubmit > 0){
+                enter(resubmit, 0, 0);
+            }
+            lock.unlock();
+            space.notify_all();
+            for(const std::pair<Op *, bool> &f : finished){
+                f.first->batch->finish(f.second);
+                delete f.first;
+            }
+            if(stop){
+                return;
+            }
+        }
+    }
+
+    int fd;
+    int ring_fd = -1;
+    void *rings = MAP_FAILED;
+    void *sqes = MAP_FAILED;
+    size_t ring_map_size = 0;
+    size_t sqe_map_size = 0;
+    unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_array = nullptr;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr;
+    unsigned sq_mask = 0, cq_mask = 0, sq_entries = 0, cq_entries = 0;
+    struct io_uring_cqe *cqes = nullptr;
+
+    std::mutex mutex;               // guards the submission queue, in_flight and stopping
+    std::condition_variable space;  // signalled when reads complete
+    unsigned in_flight = 0;         // reads submitted and not yet reaped
+    bool stopping = false;
+    std::thread reaper;
+};
+
+const int io_threads = 4;
+const unsigned io_uring_entries = 128;
+
+std::unique_ptr<IoEngine> make_io_engine(FatIoEngine kind, int fd) {
+    if(kind == FAT_IO_URING){
+        std::unique_ptr<UringEngine> uring = UringEngine::create(fd, io_uring_entries);
+        if(uring){
+            return uring;
+        }
+        FAT_TRACE(FAT_TRACE_WARN, "io_uring is not available, reading with a thread pool");
+        kind = FAT_IO_THREADS;
+    }
+    if(kind == FAT_IO_THREADS){
+        return std::unique_ptr<IoEngine>(new ThreadPoolEngine(fd, io_threads));
+    }
+    return nullptr;
+}
+
+// Bytes moved per kernel call; sendfile() and splice() move at most about 2 GiB at once
+const size_t max_send_size = 1 << 30;
+
+// Bytes staged through user space per call when no kernel call can move the data
+const size_t send_buffer_size = 64 * 1024;
+
+// Waits until out_fd, a non-blocking descriptor that just returned EAGAIN, takes more data
+static bool wait_writable(int out_fd) {
+    struct pollfd pfd = { out_fd, POLLOUT, 0 };
+    while(::poll(&pfd, 1, -1) < 0){
+        if(errno != EINTR){
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool write_all(int out_fd, const char *data, size_t length) {
+    while(length > 0){
+        ssize_t n = write(out_fd, data, length);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n < 0 && errno == EAGAIN){
+            if(!wait_writable(out_fd)){
+                return false;
+            }
+            continue;
+        }
+        if(n <= 0){
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+bool send_image_range(const FatVolume &vol, uint64_t offset, uint64_t length, int out_fd, SendMethod &method) {
+    if(vol.image_map != nullptr){
+        // the data is already in memory, so it goes to out_fd with one copy in the kernel
+        const char *data = mapped_data(vol, offset, length);
+        return data != nullptr && write_all(out_fd, data, length);
+    }
+    std::vector<char> buffer;
+    while(length > 0){
+        size_t chunk = std::min<uint64_t>(length, max_send_size);
+        off_t in_offset = offset;
+        ssize_t n = -1;
+        switch(method){
+        case SendMethod::COPY_FILE_RANGE:
+            n = copy_file_range(vol.image_fd, &in_offset, out_fd, nullptr, chunk, 0);
+            break;
+        case SendMethod::SENDFILE:
+            n = sendfile(out_fd, vol.image_fd, &in_offset, chunk);
+            break;
+        case SendMethod::SPLICE:
+            n = splice(vol.image_fd, &in_offset, out_fd, nullptr, chunk, SPLICE_F_MORE);
+            break;
+        case SendMethod::COPY:
+            buffer.resize(send_buffer_size);
+            n = pread(vol.image_fd, buffer.data(), std::min(chunk, buffer.size()), offset);
+            if(n > 0 && !write_all(out_fd, buffer.data(), n)){
+                return false;
+            }
+            break;
+        }
+        if(n > 0){
+            offset += n;
+            length -= n;
+            continue;
+        }
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n < 0 && errno == EAGAIN && method != SendMethod::COPY){
+            if(!wait_writable(out_fd)){
+                return false;
+            }
+            continue;
+        }
+        if(method == SendMethod::COPY){
+            // an I/O error, or the range runs past the end of the image
+            return false;
+        }
+        // this call can't move data between these descriptors, e.g. copy_file_range()
+        // to a socket or splice() to a regular file
+        FAT_TRACE(FAT_TRACE_DEBUG, "send method " << (int) method << " failed (" << strerror(errno) << "), trying the next");
+        method = (SendMethod) ((int) method + 1);
+    }
+    return true;
+}
@@ -0,0 +1,229 @@
+#include "fat_internal.h"
+#include <algorithm>
+#include <cstdlib>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT_SCAN_X86 1
+#endif
+
+/* Classifies one entry the way DirEntryMasks describes */
+static void classify_entry(const char *entry, uint64_t bit, DirEntryMasks &masks) {
+    uint8_t first = (uint8_t) entry[0];
+    uint8_t attr = (uint8_t) entry[11];
+    if(first == 0x00){
+        masks.free |= bit;
+    } else if(first == 0xE5){
+        masks.deleted |= bit;
+    } else if((attr & DirEntryAttributes::LONG_NAME_MASK) == DirEntryAttributes::LONG_NAME){
+        masks.long_name |= bit;
+    } else if(attr & DirEntryAttributes::VOLUME_ID){
+        masks.volume_label |= bit;
+    } else {
+        masks.live |= bit;
+    }
+}
+
+static void scan_scalar(const char *entries, uint32_t count, DirEntryMasks &masks) {
+    for(uint32_t i = 0; i < count; i++){
+        classify_entry(entries + i * 32, 1ULL << i, masks);
+    }
+}
+
+static uint64_t match_scalar(const char *entries, uint32_t count, const ShortName &name) {
+    uint64_t matches = 0;
+    for(uint32_t i = 0; i < count; i++){
+        const char *entry = entries + i * 32;
+        bool equal = true;
+        for(int j = 0; j < 11 && equal; j++){
+            equal = toupper((unsigned char) entry[j]) == (unsigned char) name[j];
+        }
+        if(equal){
+            matches |= 1ULL << i;
+        }
+    }
+    return matches;
+}
+
+static uint32_t run_scalar(const uint32_t *entries, uint32_t cluster, uint32_t count) {
+    uint32_t i = 0;
+    while(i < count && (entries[i] & 0x0FFFFFFF) == cluster + i + 1){
+        i++;
+    }
+    return i;
+}
+
+#ifdef FAT_SCAN_X86
+/* Turns the first byte and attribute byte of four entries, one per 32-bit lane of first and
+ * attr, into four bits of each mask.
+ */
+static void classify_lanes(__m128i first, __m128i attr, uint32_t shift, DirEntryMasks &masks) {
+    const __m128i byte = _mm_set1_epi32(0xFF);
+    first = _mm_and_si128(first, byte);
+    attr = _mm_srli_epi32(attr, 24);
+    __m128i is_free = _mm_cmpeq_epi32(first, _mm_setzero_si128());
+    __m128i is_deleted = _mm_cmpeq_epi32(first, _mm_set1_epi32(0xE5));
+    __m128i in_use = _mm_andnot_si128(_mm_or_si128(is_free, is_deleted), _mm_set1_epi32(-1));
+    __m128i is_long = _mm_and_si128(in_use, _mm_cmpeq_epi32(_mm_and_si128(attr, _mm_set1_epi32(LONG_NAME_MASK)),
+                                                            _mm_set1_epi32(LONG_NAME)));
+    __m128i is_label = _mm_andnot_si128(is_long, _mm_and_si128(in_use,
+        _mm_cmpeq_epi32(_mm_and_si128(attr, _mm_set1_epi32(VOLUME_ID)), _mm_set1_epi32(VOLUME_ID))));
+    __m128i is_live = _mm_andnot_si128(_mm_or_si128(is_long, is_label), in_use);
+    masks.free |= (uint64_t) _mm_movemask_ps(_mm_castsi128_ps(is_free)) << shift;
+    masks.deleted |= (uint64_t) _mm_movemask_ps(_mm_castsi128_ps(is_deleted)) << shift;
+    masks.long_name |= (uint64_t) _mm_movemask_ps(_mm_castsi128_ps(is_long)) << shift;
+    masks.volume_label |= (uint64_t) _mm_movemask_ps(_mm_castsi128_ps(is_label)) << shift;
+    masks.live |= (uint64_t) _mm_movemask_ps(_mm_castsi128_ps(is_live)) << shift;
+}
+
+// Upper-cases the ASCII letters in v
+static __m128i upper_sse2(__m128i v) {
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('z' + 1)));
+    return _mm_sub_epi8(v, _mm_and_si128(lower, _mm_set1_epi8(0x20)));
+}
+
+// Four entries per step: dwords 0 and 2 of each entry hold its first byte and attribute byte
+static void scan_sse2(const char *entries, uint32_t count, DirEntryMasks &masks) {
+    uint32_t i = 0;
+    for(; i + 4 <= count; i += 4){
+        const char *p = entries + i * 32;
+        __m128i a = _mm_loadu_si128((const __m128i *) p);
+        __m128i b = _mm_loadu_si128((const __m128i *) (p + 32));
+        __m128i c = _mm_loadu_si128((const __m128i *) (p + 64));
+        __m128i d = _mm_loadu_si128((const __m128i *) (p + 96));
+        __m128i ab_lo = _mm_unpacklo_epi32(a, b), ab_hi = _mm_unpackhi_epi32(a, b);
+        __m128i cd_lo = _mm_unpacklo_epi32(c, d), cd_hi = _mm_unpackhi_epi32(c, d);
+        classify_lanes(_mm_unpacklo_epi64(ab_lo, cd_lo), _mm_unpacklo_epi64(ab_hi, cd_hi), i, masks);
+    }
+    for(; i < count; i++){
+        classify_entry(entries + i * 32, 1ULL << i, masks);
+    }
+}
+
+static uint64_t match_sse2(const char *entries, uint32_t count, const ShortName &name) {
+    char padded[16] = {};
+    std::copy(name.begin(), name.end(), padded);
+    __m128i target = _mm_loadu_si128((const __m128i *) padded);
+    uint64_t matches = 0;
+    for(uint32_t i = 0; i < count; i++){
+        __m128i entry = upper_sse2(_mm_loadu_si128((const __m128i *) (entries + i * 32)));
+        if((_mm_movemask_epi8(_mm_cmpeq_epi8(entry, target)) & 0x7FF) == 0x7FF){
+            matches |= 1ULL << i;
+        }
+    }
+    return matches;
+}
+
+static uint32_t run_sse2(const uint32_t *entries, uint32_t cluster, uint32_t count) {
+    const __m128i mask = _mm_set1_epi32(0x0FFFFFFF);
+    __m128i next = _mm_add_epi32(_mm_set1_epi32(cluster + 1), _mm_setr_epi32(0, 1, 2, 3));
+    uint32_t i = 0;
+    for(; i + 4 <= count; i += 4){
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *) (entries + i)), mask);
+        int linked = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, next)));
+        if(linked != 0xF){
+            return i + __builtin_ctz(~linked);
+        }
+        next = _mm_add_epi32(next, _mm_set1_epi32(4));
+    }
+    return i + run_scalar(entries + i, cluster + i, count - i);
+}
+
+// Eight entries per step, gathering dwords 0 and 2 of each entry
+__attribute__((target("avx2")))
+static void scan_avx2(const char *entries, uint32_t count, DirEntryMasks &masks) {
+    const __m256i offsets = _mm256_setr_epi32(0, 8, 16, 24, 32, 40, 48, 56);   // in dwords
+    uint32_t i = 0;
+    for(; i + 8 <= count; i += 8){
+        const int *p = (const int *) (entries + i * 32);
+        __m256i first = _mm256_i32gather_epi32(p, offsets, 4);
+        __m256i attr = _mm256_i32gather_epi32(p + 2, offsets, 4);
+        classify_lanes(_mm256_castsi256_si128(first), _mm256_castsi256_si128(attr), i, masks);
+        classify_lanes(_mm256_extracti128_si256(first, 1), _mm256_extracti128_si256(attr, 1), i + 4, masks);
+    }
+    for(; i < count; i++){
+        classify_entry(entries + i * 32, 1ULL << i, masks);
+    }
+}
+
+// Two entries per compare, the first 16 bytes of each in one half of the register
+__attribute__((target("avx2")))
+static uint64_t match_avx2(const char *entries, uint32_t count, const ShortName &name) {
+    char padded[16] = {};
+    std::copy(name.begin(), name.end(), padded);
+    __m256i target = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) padded));
+    uint64_t matches = 0;
+    uint32_t i = 0;
+    for(; i + 2 <= count; i += 2){
+        const char *p = entries + i * 32;
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) p)),
+                                            _mm_loadu_si128((const __m128i *) (p + 32)), 1);
+        __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('a' - 1)),
+                                         _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), v));
+        v = _mm256_sub_epi8(v, _mm256_and_si256(lower, _mm256_set1_epi8(0x20)));
+        uint32_t equal = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, target));
+        if((equal & 0x7FF) == 0x7FF){
+            matches |= 1ULL << i;
+        }
+        if(((equal >> 16) & 0x7FF) == 0x7FF){
+            matches |= 1ULL << (i + 1);
+        }
+    }
+    if(i < count){
+        matches |= match_sse2(entries + i * 32, count - i, name) << i;
+    }
+    return matches;
+}
+
+__attribute__((target("avx2")))
+static uint32_t run_avx2(const uint32_t *entries, uint32_t cluster, uint32_t count) {
+    const __m256i mask = _mm256_set1_epi32(0x0FFFFFFF);
+    __m256i next = _mm256_add_epi32(_mm256_set1_epi32(cluster + 1), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    uint32_t i = 0;
+    for(; i + 8 <= count; i += 8){
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (entries + i)), mask);
+        int linked = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, next)));
+        if(linked != 0xFF){
+            return i + __builtin_ctz(~linked);
+        }
+        next = _mm256_add_epi32(next, _mm256_set1_epi32(8));
+    }
+    return i + run_sse2(entries + i, cluster + i, count - i);
+}
+#endif
+
+struct Scanner {
+    void (*scan)(const char *entries, uint32_t count, DirEntryMasks &masks);
+    uint64_t (*match)(const char *entries, uint32_t count, const ShortName &name);
+    uint32_t (*run)(const uint32_t *entries, uint32_t cluster, uint32_t count);
+};
+
+// Picks the widest implementation the CPU supports, or the one FAT_SCAN_ISA asks for
+static Scanner pick_scanner() {
+#ifdef FAT_SCAN_X86
+    const char *isa = getenv("FAT_SCAN_ISA");
+    std::string wanted = isa != nullptr ? isa : "";
+    __builtin_cpu_init();
+    if(wanted != "scalar" && wanted != "sse2" && __builtin_cpu_supports("avx2")){
+        return Scanner{scan_avx2, match_avx2, run_avx2};
+    }
+    if(wanted != "scalar"){
+        return Scanner{scan_sse2, match_sse2, run_sse2};
+    }
+#endif
+    return Scanner{scan_scalar, match_scalar, run_scalar};
+}
+
+static const Scanner scanner = pick_scanner();
+
+void scan_dir_entries(const char *entries, uint32_t count, DirEntryMasks &masks) {
+    masks = DirEntryMasks();
+    scanner.scan(entries, count, masks);
+}
+
+uint64_t match_dir_entries(const char *entries, uint32_t count, const ShortName &name) {
+    return scanner.match(entries, count, name);
+}
+
+uint32_t fat_run_length(const uint32_t *entries, uint32_t cluster, uint32_t count) {
+    return scanner.run(entries, cluster, count);
+}
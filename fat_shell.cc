@@ -1,4 +1,5 @@
 #include "fat.h"
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <cctype>
@@ -45,6 +46,10 @@ void do_mount(const std::vector<std::string> &args) {
     show_status("mounting " + args[0], fat_mount(args[0]));
 }
 
+void do_mmap(const std::vector<std::string> &args) {
+    show_status("mapping " + args[0], fat_mount(args[0], FAT_MOUNT_MMAP));
+}
+
 void do_open(const std::vector<std::string> &args) {
     int result = fat_open(args[0]);
     if (result < 0) {
@@ -190,11 +195,71 @@ void do_preadandsave(const std::vector<std::string> &args) {
     out.close();
 }
 
+void do_sendfile(const std::vector<std::string> &args) {
+    int fd, count, offset;
+    if (!check_integer("sendfile fd", args[0], &fd)) return;
+    if (!check_integer("sendfile size", args[1], &count)) return;
+    if (!check_integer("sendfile offset", args[2], &offset)) return;
+    const std::string &output_file = args[3];
+    int out_fd = STDOUT_FILENO;
+    if (output_file != "-") {
+        out_fd = open(output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0) {
+            std::perror(output_file.c_str());
+            return;
+        }
+    } else {
+        std::cout.flush();
+    }
+    int rv = fat_sendfile(fd, out_fd, count, offset);
+    if (out_fd != STDOUT_FILENO) {
+        close(out_fd);
+        std::cout << "sendfile from fd " << fd << ", offset " << offset << ", count " << count << " to " << output_file
+                  << ": returned " << rv << " (bytes written)" << std::endl;
+    } else if (rv < 0) {
+        std::cerr << "sendfile: returned -1 (error)" << std::endl;
+    }
+}
+
+void do_extract(const std::vector<std::string> &args) {
+    FatExtractStats stats;
+    bool ok = fat_extract(args[0], args[1], 0, &stats);
+    std::cout << "extracting " << args[0] << " to " << args[1] << ": returned " << (ok ? "true (successful)" : "false (failed)")
+              << "; " << stats.files << " files, " << stats.directories << " directories, " << stats.bytes << " bytes"
+              << std::endl;
+}
+
+void do_trace(const std::vector<std::string> &args) {
+    const std::string levels[] = { "off", "error", "warn", "info", "debug" };
+    for (int i = 0; i < 5; ++i) {
+        if (args[0] == levels[i]) {
+            fat_set_trace_level(static_cast<FatTraceLevel>(i));
+            std::cout << "trace level set to " << levels[i] << std::endl;
+            return;
+        }
+    }
+    std::cerr << "trace: '" << args[0] << "' is not one of off, error, warn, info, debug" << std::endl;
+}
+
+void do_io(const std::vector<std::string> &args) {
+    const std::string engines[] = { "sync", "threads", "uring" };
+    for (int i = 0; i < 3; ++i) {
+        if (args[0] == engines[i]) {
+            fat_set_io_engine(static_cast<FatIoEngine>(i));
+            std::cout << "images mounted from now on read with " << engines[i] << std::endl;
+            return;
+        }
+    }
+    std::cerr << "io: '" << args[0] << "' is not one of sync, threads, uring" << std::endl;
+}
+
 void do_help(const std::vector<std::string> &args) {
     std::cout << \
 "fat_shell commands:\n\
    mount FILENAME\n\
      Call fat_mount() to mount a filesystem image.\n\
+   mmap FILENAME\n\
+     Call fat_mount() to mount a filesystem image by mapping it into memory.\n\
    lsdir PATH\n\
      Call fat_readdir() on PATH and display the results in a human-readable way.\n\
      Directory entries which do not appear to represent regular files or directories\n\
@@ -214,8 +279,21 @@ void do_help(const std::vector<std::string> &args) {
      file descriptor FD.\n\
      Then write the result to a new file (outside the disk image) named\n\
      OUTPUT.\n\
+   sendfile FD COUNT OFFSET OUTPUT\n\
+     Call fat_sendfile() to write COUNT bytes starting at offset byte OFFSET\n\
+     from file descriptor FD to a new file (outside the disk image) named\n\
+     OUTPUT, or to standard output if OUTPUT is -.\n\
+   extract PATH OUTPUT\n\
+     Call fat_extract() to copy the directory PATH and everything below it\n\
+     into a new directory (outside the disk image) named OUTPUT.\n\
    close FD\n\
      Call fat_close() on file descriptor FD. Output whether it returns success\n\
+   trace LEVEL\n\
+     Call fat_set_trace_level() so the library reports diagnostics to stderr.\n\
+     LEVEL is one of off, error, warn, info or debug.\n\
+   io ENGINE\n\
+     Call fat_set_io_engine() so images mounted afterwards read file data with\n\
+     ENGINE, one of sync, threads or uring.\n\
    exit\n\
      Quit\n\
    OPERATION | SHELL-COMMAND\n\
@@ -230,11 +308,16 @@ void do_help(const std::vector<std::string> &args) {
 
 Command commands[] = {
     { "mount", do_mount, 1 },
+    { "mmap", do_mmap, 1 },
     { "lsdir", do_lsdir, 1 },
     { "open", do_open, 1 },
     { "close", do_close, 1 },
     { "pread", do_pread, 3 },
     { "preadandsave", do_preadandsave, 4 },
+    { "sendfile", do_sendfile, 4 },
+    { "extract", do_extract, 2 },
+    { "trace", do_trace, 1 },
+    { "io", do_io, 1 },
     { "help", do_help, -1 },
 };
 
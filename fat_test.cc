@@ -1,7 +1,10 @@
 #include "fat.h"
+#include "fat_coro.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -14,6 +17,8 @@
 #include <fstream>
 #include <sstream>
 #include <map>
+#include <atomic>
+#include <thread>
 
 namespace {
 bool TEST_DEBUG = false;
@@ -807,6 +812,816 @@ void a2_test(void) {
     check_contents("/a2/example3.txt", "the contents of example3.txt\n");
 }
 
+void parallel_read_tests(void) {
+    START_TEST_SET("parallel reads from several threads", "");
+    const std::vector<std::pair<std::string, std::string>> files = {
+        { "/congrats.txt", CONGRATS_TEXT },
+        { "/gamefrag.txt", THE_GAME_TEXT },
+        { "/people/yyz5w/the-game.txt", THE_GAME_TEXT },
+        { "/a1/b1/b2/b3/b4/example9.txt", "This is example 9.\n" },
+    };
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for (const auto &file : files) {
+        threads.emplace_back([&file, &failures] {
+            for (int i = 0; i < 50; ++i) {
+                int fd = fat_open(file.first);
+                if (fd < 0) {
+                    ++failures;
+                    continue;
+                }
+                std::vector<char> buffer(file.second.size() + 16);
+                int read_count = fat_pread(fd, &buffer[0], buffer.size(), 0);
+                if (read_count != (int) file.second.size() ||
+                        std::string(buffer.begin(), buffer.begin() + read_count) != file.second) {
+                    ++failures;
+                }
+                fat_close(fd);
+            }
+        });
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    CHECK(failures == 0, "every thread read the contents it expected");
+    CHECK_TEST_SET();
+}
+
+void multiple_volume_tests(void) {
+    START_TEST_SET("multiple mounted volumes", "");
+    FatVolume *first = fat_volume_mount("testdisk1.raw");
+    FatVolume *second = fat_volume_mount("testdisk1.raw", FAT_MOUNT_MMAP);
+    CHECK(first != nullptr && second != nullptr, "mounting testdisk1.raw twice");
+    if (first != nullptr && second != nullptr) {
+        int fd_one = fat_volume_open(first, "/congrats.txt");
+        int fd_two = fat_volume_open(second, "/example1.txt");
+        CHECK(fd_one >= 0 && fd_two >= 0, "opening a file on each volume");
+        CHECK(fat_volume_readdir(second, "/people").size() > 0, "readdir on the second volume");
+        fat_volume_unmount(first);
+        first = nullptr;
+        char buffer[64] = {};
+        int read_count = fat_volume_pread(second, fd_two, buffer, sizeof buffer, 0);
+        CHECK(std::string(buffer, buffer + std::max(read_count, 0)) == "the contents of example1.\n",
+              "second volume still readable after unmounting the first");
+        _check_pread_simple(fat_open("/congrats.txt"), CONGRATS_TEXT, "default volume is unaffected");
+    }
+    fat_volume_unmount(first);
+    fat_volume_unmount(second);
+    CHECK_TEST_SET();
+
+    START_TEST_SET("memory budget", "");
+    size_t in_use = fat_memory_in_use();
+    fat_set_memory_budget(in_use);
+    FatVolume *over_budget = fat_volume_mount("testdisk1.raw");
+    CHECK(over_budget != nullptr, "mounting does not need any of the budget");
+    if (over_budget != nullptr) {
+        char buffer[64] = {};
+        int fd = fat_volume_open(over_budget, "/a2/example3.txt");
+        int read_count = fat_volume_pread(over_budget, fd, buffer, sizeof buffer, 0);
+        CHECK(std::string(buffer, buffer + std::max(read_count, 0)) == "the contents of example3.txt\n",
+              "reads still work with the budget used up");
+        CHECK(fat_memory_in_use() == in_use, "nothing is cached past the budget");
+    }
+    fat_volume_unmount(over_budget);
+    fat_set_memory_budget(SIZE_MAX);
+    CHECK_TEST_SET();
+}
+
+void block_cache_tests(void) {
+    START_TEST_SET("block cache", "");
+    FatVolume *vol = fat_volume_mount("testdisk1.raw");
+    CHECK(vol != nullptr, "mounting testdisk1.raw");
+    if (vol != nullptr) {
+        CHECK(fat_volume_readdir(vol, "/people").size() > 0, "reading /people");
+        FatCacheStats before = fat_volume_cache_stats(vol);
+        CHECK(before.block_misses > 0, "first read goes to the image");
+        CHECK(fat_volume_readdir(vol, "/people").size() > 0, "reading /people again");
+        FatCacheStats after = fat_volume_cache_stats(vol);
+        CHECK(after.block_misses == before.block_misses, "second read does not miss");
+        CHECK(after.block_hits > before.block_hits, "second read is served from the cache");
+    }
+    fat_volume_unmount(vol);
+    CHECK_TEST_SET();
+}
+
+void dentry_cache_tests(void) {
+    START_TEST_SET("dentry cache", "");
+    FatVolume *vol = fat_volume_mount("testdisk1.raw");
+    CHECK(vol != nullptr, "mounting testdisk1.raw");
+    if (vol != nullptr) {
+        int fd = fat_volume_open(vol, "/a1/b1/b2/b3/example6.txt");
+        CHECK(fd >= 0, "opening /a1/b1/b2/b3/example6.txt");
+        fat_volume_close(vol, fd);
+        FatCacheStats before = fat_volume_cache_stats(vol);
+        fd = fat_volume_open(vol, "/A1/b1/B2/b3/Example6.TXT");
+        CHECK(fd >= 0, "opening it again with different case");
+        FatCacheStats after = fat_volume_cache_stats(vol);
+        CHECK(after.dentry_hits == before.dentry_hits + 1 && after.block_misses == before.block_misses &&
+              after.block_hits == before.block_hits, "second open is a single dentry hit");
+        char buffer[64] = {};
+        int read_count = fat_volume_pread(vol, fd, buffer, sizeof buffer, 0);
+        CHECK(std::string(buffer, buffer + std::max(read_count, 0)) == "This is example 6.\n",
+              "reading through the cached entry");
+        fat_volume_close(vol, fd);
+
+        CHECK(fat_volume_open(vol, "/a1/b1/no-such.txt") == -1, "opening a missing file fails");
+        before = fat_volume_cache_stats(vol);
+        CHECK(fat_volume_open(vol, "/a1/b1/no-such.txt") == -1, "opening it again fails");
+        after = fat_volume_cache_stats(vol);
+        CHECK(after.dentry_hits == before.dentry_hits + 1 && after.block_hits == before.block_hits,
+              "the miss is remembered");
+    }
+    fat_volume_unmount(vol);
+    CHECK_TEST_SET();
+}
+
+void dir_index_tests(void) {
+    START_TEST_SET("directory index", "");
+    FatVolume *vol = fat_volume_mount("testdisk1.raw");
+    CHECK(vol != nullptr, "mounting testdisk1.raw");
+    if (vol != nullptr) {
+        int fd = fat_volume_open(vol, "/a1/b1/b2/b3/example6.txt");
+        CHECK(fd >= 0, "opening /a1/b1/b2/b3/example6.txt");
+        fat_volume_close(vol, fd);
+        FatCacheStats before = fat_volume_cache_stats(vol);
+        CHECK(before.dir_index_misses > 0, "first lookups index their directories");
+        CHECK(fat_volume_open(vol, "/a1/b1/b2/b3/no-such.txt") == -1, "opening a missing file fails");
+        FatCacheStats after = fat_volume_cache_stats(vol);
+        CHECK(after.dir_index_hits == before.dir_index_hits + 1 && after.dir_index_misses == before.dir_index_misses,
+              "another name in the same directory uses its index");
+        CHECK(after.block_hits == before.block_hits && after.block_misses == before.block_misses,
+              "without reading the directory");
+        fd = fat_volume_open(vol, "/ congrats . txt");
+        CHECK(fd >= 0, "whitespace in a name is ignored");
+        fat_volume_close(vol, fd);
+        CHECK(fat_volume_open(vol, "/congratstxt") == -1, "the extension has to be separated by a dot");
+        CHECK(fat_volume_open(vol, "/congrats.txt.txt") == -1, "a name with two dots has no 8.3 form");
+        CHECK(fat_volume_open(vol, "/congratulations.txt") == -1, "nor does a long name");
+    }
+    fat_volume_unmount(vol);
+
+    fat_set_dir_index_cache_size(0);
+    vol = fat_volume_mount("testdisk1.raw");
+    CHECK(vol != nullptr, "mounting testdisk1.raw without a directory index cache");
+    if (vol != nullptr) {
+        int fd = fat_volume_open(vol, "/a1/b1/b2/b3/example6.txt");
+        CHECK(fd >= 0, "opening /a1/b1/b2/b3/example6.txt");
+        fat_volume_close(vol, fd);
+        CHECK(fat_volume_open(vol, "/a1/b1/b2/b3/no-such.txt") == -1, "opening a missing file fails");
+        CHECK(fat_volume_cache_stats(vol).dir_index_hits == 0, "nothing is kept");
+    }
+    fat_volume_unmount(vol);
+    fat_set_dir_index_cache_size(16 * 1024 * 1024);
+    CHECK_TEST_SET();
+}
+
+void readahead_tests(void) {
+    START_TEST_SET("sequential readahead", "");
+    const std::string expected = THE_GAME_TEXT;
+    for (size_t window : { (size_t) 2 * 1024 * 1024, (size_t) 0 }) {
+        fat_set_readahead_size(window);
+        FatVolume *vol = fat_volume_mount("testdisk1.raw");
+        CHECK(vol != nullptr, "mounting testdisk1.raw");
+        if (vol == nullptr) {
+            continue;
+        }
+        int fd = fat_volume_open(vol, "/gamefrag.txt");
+        CHECK(fd >= 0, "opening /gamefrag.txt");
+        std::string contents;
+        char buffer[100];
+        int read_count;
+        while ((read_count = fat_volume_pread(vol, fd, buffer, sizeof buffer, contents.size())) > 0) {
+            contents.append(buffer, read_count);
+        }
+        CHECK(contents == expected, "reading /gamefrag.txt front to back, readahead size " << window);
+        read_count = fat_volume_pread(vol, fd, buffer, sizeof buffer, 7);
+        CHECK(read_count == sizeof buffer && std::string(buffer, read_count) == expected.substr(7, sizeof buffer),
+              "reading out of order afterwards");
+        uint64_t hits = fat_volume_cache_stats(vol).readahead_hits;
+        if (window != 0) {
+            CHECK(hits > 0, "later reads are served from readahead");
+        } else {
+            CHECK(hits == 0, "nothing is read ahead when it is off");
+        }
+        fat_volume_close(vol, fd);
+        fat_volume_unmount(vol);
+    }
+    fat_set_readahead_size(2 * 1024 * 1024);
+    CHECK_TEST_SET();
+}
+
+void io_engine_tests(void) {
+    START_TEST_SET("io engines", "");
+    const std::vector<std::pair<std::string, std::string>> files = {
+        { "/congrats.txt", CONGRATS_TEXT },
+        { "/gamefrag.txt", THE_GAME_TEXT },
+        { "/people/yyz5w/the-game.txt", THE_GAME_TEXT },
+    };
+    for (FatIoEngine engine : { FAT_IO_THREADS, FAT_IO_URING }) {
+        fat_set_io_engine(engine);
+        FatVolume *vol = fat_volume_mount("testdisk1.raw");
+        CHECK(vol != nullptr, "mounting testdisk1.raw with engine " << engine);
+        if (vol == nullptr) {
+            continue;
+        }
+        CHECK(fat_volume_io_engine(vol) != FAT_IO_SYNC, "the volume has an engine");
+        std::atomic<int> bad(0);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&, t] {
+                for (int i = 0; i < 20; i++) {
+                    const std::pair<std::string, std::string> &file = files[(t + i) % files.size()];
+                    int fd = fat_volume_open(vol, file.first);
+                    std::vector<char> buffer(file.second.size() + 10);
+                    int read_count = fat_volume_pread(vol, fd, buffer.data(), buffer.size(), 0);
+                    if (read_count < 0 || std::string(buffer.data(), read_count) != file.second) {
+                        bad++;
+                    }
+                    fat_volume_close(vol, fd);
+                }
+            });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        CHECK(bad == 0, "every read returns the file's contents, engine " << engine);
+        fat_volume_unmount(vol);
+    }
+    fat_set_io_engine(FAT_IO_SYNC);
+    CHECK_TEST_SET();
+}
+
+void async_read_tests(void) {
+    START_TEST_SET("asynchronous reads", "");
+    const std::vector<std::pair<std::string, std::string>> files = {
+        { "/congrats.txt", CONGRATS_TEXT },
+        { "/gamefrag.txt", THE_GAME_TEXT },
+        { "/people/yyz5w/the-game.txt", THE_GAME_TEXT },
+    };
+    for (FatIoEngine engine : { FAT_IO_SYNC, FAT_IO_URING }) {
+        fat_set_io_engine(engine);
+        FatVolume *vol = fat_volume_mount("testdisk1.raw");
+        CHECK(vol != nullptr, "mounting testdisk1.raw with engine " << engine);
+        if (vol == nullptr) {
+            continue;
+        }
+        std::vector<int> fds;
+        std::vector<std::vector<char>> buffers;
+        for (const std::pair<std::string, std::string> &file : files) {
+            fds.push_back(fat_volume_open(vol, file.first));
+            buffers.emplace_back(file.second.size() + 10);
+        }
+
+        std::vector<std::future<int>> futures;
+        for (size_t i = 0; i < files.size(); i++) {
+            futures.push_back(fat_volume_pread_async(vol, fds[i], buffers[i].data(), buffers[i].size(), 0));
+        }
+        for (size_t i = 0; i < files.size(); i++) {
+            int read_count = futures[i].get();
+            CHECK(read_count >= 0 && std::string(buffers[i].data(), read_count) == files[i].second,
+                  "future for " << files[i].first << ", engine " << engine);
+        }
+
+        int event_fd = fat_volume_event_fd(vol);
+        CHECK(event_fd >= 0, "getting the event fd");
+        std::vector<int> results(files.size(), -2);
+        for (size_t i = 0; i < files.size(); i++) {
+            std::fill(buffers[i].begin(), buffers[i].end(), 0);
+            fat_volume_pread_async(vol, fds[i], buffers[i].data(), buffers[i].size(), 0,
+                                   [&results, i](int n) { results[i] = n; });
+        }
+        int bad_fd_result = 0;
+        fat_volume_pread_async(vol, 127, buffers[0].data(), 1, 0, [&bad_fd_result](int n) { bad_fd_result = n; });
+        size_t called = 0;
+        while (called < files.size() + 1) {
+            struct pollfd pfd = { event_fd, POLLIN, 0 };
+            if (poll(&pfd, 1, 5000) <= 0) {
+                break;
+            }
+            called += fat_volume_poll(vol);
+        }
+        CHECK(called == files.size() + 1, "every callback runs from fat_volume_poll()");
+        for (size_t i = 0; i < files.size(); i++) {
+            CHECK(results[i] >= 0 && std::string(buffers[i].data(), results[i]) == files[i].second,
+                  "callback for " << files[i].first << ", engine " << engine);
+        }
+        CHECK(bad_fd_result == -1, "reading a closed fd fails");
+        for (int fd : fds) {
+            fat_volume_close(vol, fd);
+        }
+        fat_volume_unmount(vol);
+    }
+    fat_set_io_engine(FAT_IO_SYNC);
+    CHECK_TEST_SET();
+}
+
+FatTask<int> read_whole_file(FatAsyncVolume &vol, std::string path, std::string *contents) {
+    int fd = vol.open(path);
+    if (fd < 0) {
+        co_return -1;
+    }
+    char buffer[100];
+    int read_count;
+    while ((read_count = co_await vol.pread(fd, buffer, sizeof buffer, contents->size())) > 0) {
+        contents->append(buffer, read_count);
+    }
+    vol.close(fd);
+    co_return read_count;
+}
+
+FatTask<void> check_file_task(FatAsyncVolume &vol, std::string path, std::string expected, int *bad) {
+    std::string contents;
+    int result = co_await read_whole_file(vol, path, &contents);
+    if (result != 0 || contents != expected) {
+        (*bad)++;
+    }
+}
+
+void coroutine_tests(void) {
+    START_TEST_SET("coroutines", "");
+    for (FatIoEngine engine : { FAT_IO_SYNC, FAT_IO_URING }) {
+        fat_set_io_engine(engine);
+        FatVolume *volume = fat_volume_mount("testdisk1.raw");
+        CHECK(volume != nullptr, "mounting testdisk1.raw with engine " << engine);
+        if (volume == nullptr) {
+            continue;
+        }
+        {
+            FatExecutor executor;
+            FatAsyncVolume vol(executor, volume);
+            int bad = 0;
+            for (int i = 0; i < 10; i++) {
+                executor.spawn(check_file_task(vol, "/gamefrag.txt", THE_GAME_TEXT, &bad));
+                executor.spawn(check_file_task(vol, "/congrats.txt", CONGRATS_TEXT, &bad));
+            }
+            executor.run();
+            CHECK(bad == 0, "concurrent tasks read whole files, engine " << engine);
+
+            std::vector<AnyDirEntry> entries = executor.block_on(vol.readdir("/people"));
+            CHECK(entries.size() == fat_volume_readdir(volume, "/people").size(), "co_await readdir");
+            std::string contents;
+            CHECK(executor.block_on(read_whole_file(vol, "/no-such.txt", &contents)) == -1,
+                  "opening a missing file from a coroutine fails");
+        }
+        fat_volume_unmount(volume);
+    }
+    fat_set_io_engine(FAT_IO_SYNC);
+    CHECK_TEST_SET();
+}
+
+void preadv_tests(void) {
+    START_TEST_SET("batched reads", "");
+    const std::string game = THE_GAME_TEXT;
+    const std::string congrats = CONGRATS_TEXT;
+    for (FatMountMode mode : { FAT_MOUNT_READ, FAT_MOUNT_MMAP }) {
+        for (FatIoEngine engine : { FAT_IO_SYNC, FAT_IO_URING }) {
+            fat_set_io_engine(engine);
+            FatVolume *vol = fat_volume_mount("testdisk1.raw", mode);
+            CHECK(vol != nullptr, "mounting testdisk1.raw");
+            if (vol == nullptr) {
+                continue;
+            }
+            int frag = fat_volume_open(vol, "/gamefrag.txt");
+            int copy = fat_volume_open(vol, "/gamecopy.txt");
+            int small = fat_volume_open(vol, "/congrats.txt");
+            std::vector<std::vector<char>> buffers(8, std::vector<char>(game.size() + 10, 0));
+            std::vector<FatReadRequest> requests = {
+                { frag, buffers[0].data(), 600, 0, 0 },
+                { frag, buffers[1].data(), 700, 300, 0 },       // overlaps the first
+                { copy, buffers[2].data(), 1000, 1, 0 },
+                { small, buffers[3].data(), 10000, 0, 0 },      // runs past the end
+                { frag, buffers[4].data(), (int) game.size(), 0, 0 },
+                { copy, buffers[5].data(), 10, (int) game.size() + 5, 0 },  // starts past the end
+                { 127, buffers[6].data(), 10, 0, 0 },           // not open
+                { copy, buffers[7].data(), 0, 0, 0 },
+            };
+            CHECK(!fat_volume_preadv(vol, requests), "a batch with a bad fd reports failure");
+            CHECK(requests[0].result == 600 && std::string(buffers[0].data(), 600) == game.substr(0, 600), "first range");
+            CHECK(requests[1].result == 700 && std::string(buffers[1].data(), 700) == game.substr(300, 700),
+                  "overlapping range");
+            CHECK(requests[2].result == 1000 && std::string(buffers[2].data(), 1000) == game.substr(1, 1000),
+                  "range of another file");
+            CHECK(requests[3].result == (int) congrats.size() &&
+                  std::string(buffers[3].data(), congrats.size()) == congrats, "range trimmed to the file");
+            CHECK(requests[4].result == (int) game.size() && std::string(buffers[4].data(), game.size()) == game,
+                  "whole fragmented file");
+            CHECK(requests[5].result == 0, "range past the end");
+            CHECK(requests[6].result == -1, "bad fd");
+            CHECK(requests[7].result == 0, "empty range");
+            requests.erase(requests.begin() + 6);
+            CHECK(fat_volume_preadv(vol, requests), "a batch of good requests succeeds");
+            fat_volume_unmount(vol);
+        }
+    }
+    fat_set_io_engine(FAT_IO_SYNC);
+    CHECK_TEST_SET();
+}
+
+// Joins the spans of view
+std::string view_text(const FatView &view) {
+    std::string text;
+    for (const FatSpan &span : view.spans) {
+        text.append(span.data, span.size);
+    }
+    return text;
+}
+
+void view_tests(void) {
+    START_TEST_SET("zero-copy views", "");
+    const std::string game = THE_GAME_TEXT;
+    for (FatMountMode mode : { FAT_MOUNT_READ, FAT_MOUNT_MMAP }) {
+        FatVolume *vol = fat_volume_mount("testdisk1.raw", mode);
+        CHECK(vol != nullptr, "mounting testdisk1.raw");
+        if (vol == nullptr) {
+            continue;
+        }
+        int frag = fat_volume_open(vol, "/gamefrag.txt");
+        FatView view;
+        CHECK(fat_volume_view(vol, frag, (int) game.size(), 0, view) == (int) game.size() &&
+              view_text(view) == game, "view of a whole fragmented file");
+        CHECK(view.spans.size() > 1, "a fragmented file takes several spans");
+        CHECK(fat_volume_view(vol, frag, 1000, 700, view) == 1000 && view_text(view) == game.substr(700, 1000),
+              "view of a range");
+        CHECK(fat_volume_view(vol, frag, 100, (int) game.size() - 10, view) == 10 &&
+              view_text(view) == game.substr(game.size() - 10), "view trimmed to the file");
+        CHECK(fat_volume_view(vol, frag, 10, (int) game.size(), view) == 0 && view.spans.empty(), "view past the end");
+        CHECK(fat_volume_view(vol, 127, 10, 0, view) == -1 && view.spans.empty() && !view.pin, "view of a bad fd");
+        CHECK(fat_volume_view(vol, frag, (int) game.size(), 0, view) == (int) game.size(), "viewing the file again");
+        fat_volume_close(vol, frag);
+        fat_volume_unmount(vol);
+        // the pinned memory outlives the volume
+        CHECK(view_text(view) == game, "view stays valid after unmounting");
+        view = FatView();
+    }
+    CHECK_TEST_SET();
+}
+
+// Reads what is left in fd from its start
+std::string read_back(int fd) {
+    std::string text;
+    char buffer[4096];
+    lseek(fd, 0, SEEK_SET);
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        text.append(buffer, n);
+    }
+    return text;
+}
+
+void sendfile_tests(void) {
+    START_TEST_SET("sending files to descriptors", "");
+    const std::string game = THE_GAME_TEXT;
+    for (FatMountMode mode : { FAT_MOUNT_READ, FAT_MOUNT_MMAP }) {
+        FatVolume *vol = fat_volume_mount("testdisk1.raw", mode);
+        CHECK(vol != nullptr, "mounting testdisk1.raw");
+        if (vol == nullptr) {
+            continue;
+        }
+        int frag = fat_volume_open(vol, "/gamefrag.txt");
+        char path[] = "/tmp/fat_test_sendXXXXXX";
+        int out = mkstemp(path);
+        CHECK(out >= 0, "creating a temporary file");
+        if (out >= 0) {
+            unlink(path);
+            CHECK(fat_volume_sendfile(vol, frag, out, (int) game.size() + 10, 0) == (int) game.size(),
+                  "sending a whole fragmented file to a file");
+            CHECK(fat_volume_sendfile(vol, frag, out, 1000, 700) == 1000, "appending a range");
+            CHECK(read_back(out) == game + game.substr(700, 1000), "the file holds what was sent");
+            CHECK(fat_volume_sendfile(vol, frag, out, 10, (int) game.size()) == 0, "sending past the end");
+            CHECK(fat_volume_sendfile(vol, 127, out, 10, 0) == -1, "sending from a bad fd");
+            close(out);
+        }
+        int fds[2];
+        CHECK(pipe(fds) == 0, "creating a pipe");
+        std::string received;
+        std::thread reader([&received, &fds] {
+            char buffer[4096];
+            ssize_t n;
+            while ((n = read(fds[0], buffer, sizeof(buffer))) > 0) {
+                received.append(buffer, n);
+            }
+        });
+        CHECK(fat_volume_sendfile(vol, frag, fds[1], (int) game.size(), 0) == (int) game.size(),
+              "sending a whole file to a pipe");
+        close(fds[1]);
+        reader.join();
+        close(fds[0]);
+        CHECK(received == game, "the pipe carries the file");
+        fat_volume_unmount(vol);
+    }
+    CHECK_TEST_SET();
+}
+
+void fd_table_tests(void) {
+    START_TEST_SET("file descriptor table", "");
+    const std::string congrats = CONGRATS_TEXT;
+    FatVolume *vol = fat_volume_mount("testdisk1.raw");
+    CHECK(vol != nullptr, "mounting testdisk1.raw");
+    if (vol == nullptr) {
+        CHECK_TEST_SET();
+        return;
+    }
+    // far more than the old fixed table held
+    std::vector<int> fds;
+    for (int i = 0; i < 5000; ++i) {
+        fds.push_back(fat_volume_open(vol, "/congrats.txt"));
+    }
+    CHECK(std::find(fds.begin(), fds.end(), -1) == fds.end(), "opening 5000 files");
+    std::vector<int> sorted = fds;
+    std::sort(sorted.begin(), sorted.end());
+    CHECK(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end(), "every descriptor is different");
+    std::vector<char> buffer(congrats.size());
+    CHECK(fat_volume_pread(vol, fds.back(), buffer.data(), buffer.size(), 0) == (int) congrats.size() &&
+          std::string(buffer.data(), buffer.size()) == congrats, "reading the last one");
+    bool closed = true;
+    for (int fd : fds) {
+        closed = fat_volume_close(vol, fd) && closed;
+    }
+    CHECK(closed, "closing them all");
+    CHECK(!fat_volume_close(vol, fds[0]), "closing one twice fails");
+
+    // a reused slot gets a new descriptor, so the old one stays dead
+    int stale = fat_volume_open(vol, "/congrats.txt");
+    fat_volume_close(vol, stale);
+    int fresh = fat_volume_open(vol, "/gamefrag.txt");
+    CHECK(fresh >= 0 && fresh != stale, "reopening gives a new descriptor");
+    CHECK(fat_volume_pread(vol, stale, buffer.data(), 10, 0) == -1, "reading a closed descriptor fails");
+    CHECK(!fat_volume_close(vol, stale), "closing a closed descriptor fails");
+    CHECK(fat_volume_pread(vol, fresh, buffer.data(), 10, 0) == 10, "the new descriptor still reads");
+
+    // threads opening, reading and closing at once
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+        threads.emplace_back([vol, &congrats, &failures, fresh] {
+            std::vector<char> data(congrats.size());
+            for (int i = 0; i < 300; ++i) {
+                int fd = fat_volume_open(vol, "/congrats.txt");
+                if (fd < 0 || fat_volume_pread(vol, fd, data.data(), data.size(), 0) != (int) data.size() ||
+                    std::string(data.data(), data.size()) != congrats || !fat_volume_close(vol, fd) ||
+                    fat_volume_pread(vol, fd, data.data(), 1, 0) != -1 ||
+                    fat_volume_pread(vol, fresh, data.data(), 10, 0) != 10) {
+                    failures++;
+                }
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    CHECK(failures == 0, "opening, reading and closing from 8 threads");
+    fat_volume_close(vol, fresh);
+    fat_volume_unmount(vol);
+    CHECK_TEST_SET();
+}
+
+// NAME.EXT of dir without padding
+std::string short_name(const DirEntry &dir) {
+    std::string name((const char *) dir.DIR_Name, 8);
+    std::string ext((const char *) dir.DIR_Name + 8, 3);
+    name = name.substr(0, name.find_last_not_of(' ') + 1);
+    ext = ext.substr(0, ext.find_last_not_of(' ') + 1);
+    return name + (ext.empty() ? "" : "." + ext);
+}
+
+void open_entry_tests(void) {
+    START_TEST_SET("opening by directory entry", "");
+    FatVolume *vol = fat_volume_mount("testdisk1.raw");
+    CHECK(vol != nullptr, "mounting testdisk1.raw");
+    if (vol == nullptr) {
+        CHECK_TEST_SET();
+        return;
+    }
+    std::vector<AnyDirEntry> entries = fat_volume_readdir(vol, "/");
+    int files = 0;
+    bool all_match = true;
+    for (const AnyDirEntry &any : entries) {
+        const DirEntry &dir = any.dir;
+        if ((dir.DIR_Attr & LONG_NAME_MASK) == LONG_NAME || (dir.DIR_Attr & (DIRECTORY | VOLUME_ID)) ||
+            dir.DIR_Name[0] == 0xE5) {
+            continue;
+        }
+        files++;
+        std::string path = "/" + short_name(dir);
+        uint32_t cluster = ((uint32_t) dir.DIR_FstClusHI << 16) | dir.DIR_FstClusLO;
+        int by_path = fat_volume_open(vol, path);
+        int by_entry = fat_volume_open_entry(vol, dir);
+        int by_cluster = fat_volume_open_cluster(vol, cluster, dir.DIR_FileSize);
+        std::vector<char> expected(dir.DIR_FileSize + 1), got(dir.DIR_FileSize + 1);
+        int n = fat_volume_pread(vol, by_path, expected.data(), expected.size(), 0);
+        for (int fd : { by_entry, by_cluster }) {
+            if (fd < 0 || fat_volume_pread(vol, fd, got.data(), got.size(), 0) != n || got != expected) {
+                all_match = false;
+            }
+            fat_volume_close(vol, fd);
+        }
+        fat_volume_close(vol, by_path);
+    }
+    CHECK(files > 0, "the root directory has files");
+    CHECK(all_match, "files opened by entry and by cluster read like those opened by path");
+    for (const AnyDirEntry &any : entries) {
+        if ((any.dir.DIR_Attr & LONG_NAME_MASK) != LONG_NAME && (any.dir.DIR_Attr & DIRECTORY)) {
+            CHECK(fat_volume_open_entry(vol, any.dir) == -1, "a directory can't be opened as a file");
+            break;
+        }
+    }
+    CHECK(fat_volume_open_cluster(vol, 1, 100) == -1, "cluster 1 is not a data cluster");
+    CHECK(fat_volume_open_cluster(vol, 0xFFFFFFF, 100) == -1, "a cluster past the end of the volume");
+    int empty = fat_volume_open_cluster(vol, 0, 0);
+    char c;
+    CHECK(empty >= 0 && fat_volume_pread(vol, empty, &c, 1, 0) == 0, "an empty file needs no cluster");
+    fat_volume_unmount(vol);
+    CHECK_TEST_SET();
+}
+
+void dir_stream_tests(void) {
+    START_TEST_SET("streaming directory listing", "");
+    for (FatMountMode mode : { FAT_MOUNT_READ, FAT_MOUNT_MMAP }) {
+        FatVolume *vol = fat_volume_mount("testdisk1.raw", mode);
+        CHECK(vol != nullptr, "mounting testdisk1.raw");
+        if (vol == nullptr) {
+            continue;
+        }
+        for (const std::string path : { "/", "/people", "/a1/b1" }) {
+            std::vector<AnyDirEntry> expected = fat_volume_readdir(vol, path);
+            FatDirStream dir(vol, path);
+            size_t i = 0;
+            bool same = true;
+            for (const AnyDirEntry &entry : dir) {
+                same = same && i < expected.size() && memcmp(&entry, &expected[i], sizeof(entry)) == 0;
+                i++;
+            }
+            CHECK(dir.ok() && same && i == expected.size() && i > 0, "streaming " << path << " matches fat_readdir()");
+        }
+        FatDirStream dir(vol, "/");
+        int seen = 0;
+        for (FatDirStream::iterator it = dir.begin(); it != dir.end(); ++it) {
+            if (++seen == 3) {
+                break;
+            }
+        }
+        std::vector<AnyDirEntry> root = fat_volume_readdir(vol, "/");
+        CHECK(seen == 3 && dir.begin() != dir.end() && memcmp(&*dir.begin(), &root[2], sizeof(AnyDirEntry)) == 0,
+              "stopping early and picking up where the loop left off");
+        FatDirStream missing(vol, "/no-such-dir");
+        CHECK(!missing.ok() && missing.begin() == missing.end(), "a missing directory lists nothing");
+        FatDirStream relative(vol, "people");
+        CHECK(!relative.ok() && relative.begin() == relative.end(), "a relative path lists nothing");
+        fat_volume_unmount(vol);
+    }
+    CHECK_TEST_SET();
+}
+
+// Lists the tree below path one directory at a time with fat_volume_readdir()
+void walk_with_readdir(FatVolume *vol, const std::string &path, std::map<std::string, DirEntry> &found) {
+    for (const AnyDirEntry &any : fat_volume_readdir(vol, path)) {
+        const DirEntry &dir = any.dir;
+        if (dir.DIR_Name[0] == 0x00 || dir.DIR_Name[0] == 0xE5 || dir.DIR_Name[0] == '.' ||
+            (dir.DIR_Attr & LONG_NAME_MASK) == LONG_NAME || (dir.DIR_Attr & VOLUME_ID)) {
+            continue;
+        }
+        std::string child = path.substr(0, path.find_last_not_of('/') + 1) + "/" + short_name(dir);
+        found[child] = dir;
+        if (dir.DIR_Attr & DIRECTORY) {
+            walk_with_readdir(vol, child, found);
+        }
+    }
+}
+
+void walk_tests(void) {
+    START_TEST_SET("parallel tree walk", "");
+    FatVolume *vol = fat_volume_mount("testdisk1.raw");
+    CHECK(vol != nullptr, "mounting testdisk1.raw");
+    if (vol == nullptr) {
+        CHECK_TEST_SET();
+        return;
+    }
+    for (const std::string root : { "/", "/a1", "/people/" }) {
+        std::map<std::string, DirEntry> expected;
+        walk_with_readdir(vol, root, expected);
+        for (unsigned threads : { 1u, 8u }) {
+            std::mutex mutex;
+            std::map<std::string, FatFileInfo> found;
+            int duplicates = 0;
+            bool walked = fat_volume_walk(vol, root, [&](const FatFileInfo &info) {
+                std::lock_guard<std::mutex> lock(mutex);
+                duplicates += !found.emplace(info.path, info).second;
+            }, threads);
+            bool same = found.size() == expected.size() && duplicates == 0;
+            for (const auto &entry : expected) {
+                auto it = found.find(entry.first);
+                same = same && it != found.end() && memcmp(&it->second.entry, &entry.second, sizeof(DirEntry)) == 0 &&
+                       it->second.size == entry.second.DIR_FileSize && it->second.attributes == entry.second.DIR_Attr &&
+                       it->second.first_cluster == (((uint32_t) entry.second.DIR_FstClusHI << 16) | entry.second.DIR_FstClusLO);
+            }
+            CHECK(walked && same && !expected.empty(),
+                  "walking " << root << " with " << threads << " threads finds what fat_readdir() does");
+        }
+    }
+    std::atomic<int> files(0);
+    fat_volume_walk(vol, "/", [&files, vol](const FatFileInfo &info) {
+        if (info.path == "/CONGRATS.TXT") {
+            int fd = fat_volume_open_entry(vol, info.entry);
+            files += fd >= 0;
+        }
+    }, 4);
+    CHECK(files == 1, "a walked entry can be opened with fat_volume_open_entry()");
+    CHECK(!fat_volume_walk(vol, "/no-such-dir", [](const FatFileInfo &) {}), "walking a missing directory fails");
+    CHECK(!fat_volume_walk(vol, "/congrats.txt", [](const FatFileInfo &) {}), "walking a file fails");
+    fat_volume_unmount(vol);
+    CHECK_TEST_SET();
+}
+
+void extract_tests(void) {
+    START_TEST_SET("extracting a whole image", "");
+    for (FatMountMode mode : { FAT_MOUNT_READ, FAT_MOUNT_MMAP }) {
+        FatVolume *vol = fat_volume_mount("testdisk1.raw", mode);
+        CHECK(vol != nullptr, "mounting testdisk1.raw");
+        if (vol == nullptr) {
+            continue;
+        }
+        std::map<std::string, DirEntry> expected;
+        walk_with_readdir(vol, "/", expected);
+        for (unsigned threads : { 1u, 4u }) {
+            char host_dir[] = "/tmp/fat_test_extractXXXXXX";
+            CHECK(mkdtemp(host_dir) != nullptr, "creating a temporary directory");
+            std::string out = std::string(host_dir) + "/image";
+            FatExtractStats stats;
+            CHECK(fat_volume_extract(vol, "/", out, threads, &stats), "extracting / with " << threads << " threads");
+            size_t files = 0, directories = 0;
+            bool same = true;
+            for (const auto &entry : expected) {
+                const DirEntry &dir = entry.second;
+                std::string host_path = out + entry.first;
+                if (dir.DIR_Attr & DIRECTORY) {
+                    directories++;
+                    struct stat st;
+                    same = same && stat(host_path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+                    continue;
+                }
+                files++;
+                int fd = fat_volume_open_entry(vol, dir);
+                std::vector<char> data(dir.DIR_FileSize);
+                same = same && fat_volume_pread(vol, fd, data.data(), data.size(), 0) == (int) data.size();
+                fat_volume_close(vol, fd);
+                std::ifstream in(host_path, std::ios::binary);
+                std::string written((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+                same = same && in.is_open() && written == std::string(data.begin(), data.end());
+            }
+            CHECK(same, "every file and directory is on the host with the same contents");
+            CHECK(stats.files == files && stats.directories == directories && files > 0, "counting what was extracted");
+            std::string command = std::string("rm -rf ") + host_dir;
+            CHECK(system(command.c_str()) == 0, "removing the temporary directory");
+        }
+        fat_volume_unmount(vol);
+    }
+    FatVolume *vol = fat_volume_mount("testdisk1.raw");
+    char host_dir[] = "/tmp/fat_test_extractXXXXXX";
+    if (vol != nullptr && mkdtemp(host_dir) != nullptr) {
+        std::string out = std::string(host_dir) + "/people";
+        CHECK(fat_volume_extract(vol, "/people", out), "extracting a subdirectory");
+        struct stat st;
+        CHECK(stat((out + "/YYZ5W/THE-GAME.TXT").c_str(), &st) == 0 && st.st_size == (off_t) strlen(THE_GAME_TEXT),
+              "paths are relative to the extracted directory");
+        CHECK(!fat_volume_extract(vol, "/no-such-dir", out), "extracting a missing directory fails");
+        std::string command = std::string("rm -rf ") + host_dir;
+        CHECK(system(command.c_str()) == 0, "removing the temporary directory");
+    }
+    fat_volume_unmount(vol);
+    CHECK_TEST_SET();
+}
+
+void trace_tests(void) {
+    START_TEST_SET("tracing", "");
+    std::vector<std::string> messages;
+    fat_set_trace_sink([&messages](FatTraceLevel level, const std::string &message) {
+        messages.push_back(message);
+    });
+    CHECK(fat_open("/no-such.txt") == -1, "opening /no-such.txt fails");
+    CHECK(messages.empty(), "nothing is traced by default");
+    fat_set_trace_level(FAT_TRACE_INFO);
+    CHECK(fat_open("/no-such.txt") == -1, "opening /no-such.txt fails");
+    CHECK(!messages.empty(), "failed lookup is traced at FAT_TRACE_INFO");
+    fat_set_trace_level(FAT_TRACE_OFF);
+    fat_set_trace_sink(nullptr);
+    CHECK_TEST_SET();
+}
+
+void mmap_tests(void) {
+    bool mounted = fat_mount("testdisk1.raw", FAT_MOUNT_MMAP);
+    START_TEST_SET("mount with FAT_MOUNT_MMAP", "");
+    CHECK(mounted, "mapping testdisk1.raw successful");
+    CHECK_TEST_SET();
+    if (!mounted) {
+        return;
+    }
+    check_root_dir("/", true);
+    check_people_dir("/people");
+    check_contents("/congrats.txt", CONGRATS_TEXT, false);
+    check_contents("/gamefrag.txt", THE_GAME_TEXT, false);
+    check_contents("/people/yyz5w/the-game.txt", THE_GAME_TEXT);
+}
+
 void mounted_tests(void) {
     bool mounted = fat_mount("testdisk1.raw");
     CHECK(mounted, "mounting testdisk1.raw successful");
@@ -869,6 +1684,25 @@ void mounted_tests(void) {
     CHECK_TEST_SET();
     fork_and_run(a1_test);
     fork_and_run(a2_test);
+    fork_and_run(parallel_read_tests);
+    fork_and_run(multiple_volume_tests);
+    fork_and_run(block_cache_tests);
+    fork_and_run(dentry_cache_tests);
+    fork_and_run(dir_index_tests);
+    fork_and_run(readahead_tests);
+    fork_and_run(io_engine_tests);
+    fork_and_run(async_read_tests);
+    fork_and_run(coroutine_tests);
+    fork_and_run(preadv_tests);
+    fork_and_run(view_tests);
+    fork_and_run(sendfile_tests);
+    fork_and_run(fd_table_tests);
+    fork_and_run(open_entry_tests);
+    fork_and_run(dir_stream_tests);
+    fork_and_run(walk_tests);
+    fork_and_run(extract_tests);
+    fork_and_run(trace_tests);
+    fork_and_run(mmap_tests);
 }
 
 void premount_tests() {
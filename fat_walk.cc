@@ -0,0 +1,203 @@
+#include "fat_internal.h"
+#include <time.h>
+#include <thread>
+#include <unordered_set>
+
+/* A directory waiting to be listed */
+struct WalkTask {
+    std::string path;       // "" for the root, so children are "/NAME"
+    uint32_t cluster;
+};
+
+/* Threads listing the directories of a tree. Each thread pushes the subdirectories it finds
+ * onto its own deque and pops from the back, so it keeps walking down the subtree it is in
+ * and reads clusters the block cache has just seen. A thread that runs out steals from the
+ * front of another's deque, which holds the shallowest and so likely the largest subtree
+ * left.
+ */
+class TreeWalk {
+public:
+    TreeWalk(const FatVolume &vol, const FatWalkCallback &visit, unsigned threads):
+        vol(vol), visit(visit), queues(threads) {}
+
+    // Walks the tree below root and returns false if any directory could not be read
+    bool run(WalkTask root) {
+        seen.insert(root.cluster);
+        push(0, std::move(root));
+        std::vector<std::thread> workers;
+        for(unsigned i = 1; i < queues.size(); i++){
+            workers.emplace_back(&TreeWalk::work, this, i);
+        }
+        work(0);
+        for(std::thread &worker : workers){
+            worker.join();
+        }
+        return ok;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<WalkTask> tasks;
+    };
+
+    void push(unsigned worker, WalkTask task) {
+        pending++;
+        {
+            std::lock_guard<std::mutex> lock(queues[worker].mutex);
+            queues[worker].tasks.push_back(std::move(task));
+        }
+        queued++;
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        idle.notify_one();
+    }
+
+    bool pop(unsigned worker, WalkTask &task) {
+        for(unsigned i = 0; i < queues.size(); i++){
+            Queue &queue = queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if(queue.tasks.empty()){
+                continue;
+            }
+            if(i == 0){
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void work(unsigned worker) {
+        while(true){
+            WalkTask task;
+            if(pop(worker, task)){
+                list(worker, task);
+                if(--pending == 0){
+                    std::lock_guard<std::mutex> lock(idle_mutex);
+                    idle.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(idle_mutex);
+            idle.wait(lock, [this] { return queued > 0 || pending == 0; });
+            if(pending == 0){
+                return;
+            }
+        }
+    }
+
+    void list(unsigned worker, const WalkTask &task) {
+        bool read_ok = visit_live_entries(vol, task.cluster, [&](const DirEntry &dir) {
+            if(dir.DIR_Name[0] == '.'){
+                return;     // . and ..
+            }
+            FatFileInfo info;
+            info.path = task.path + "/" + entry_name(dir);
+            info.attributes = dir.DIR_Attr;
+            info.size = dir.DIR_FileSize;
+            info.first_cluster = get_dir_cluster_num(dir);
+            info.created = fat_time(dir.DIR_CrtDate, dir.DIR_CrtTime) + dir.DIR_CrtTimeTenth / 100;
+            info.modified = fat_time(dir.DIR_WrtDate, dir.DIR_WrtTime);
+            info.accessed = fat_time(dir.DIR_LstAccDate, 0);
+            info.entry = dir;
+            visit(info);
+            if(!(dir.DIR_Attr & DirEntryAttributes::DIRECTORY)){
+                return;
+            }
+            if(info.first_cluster < 2 || info.first_cluster >= vol.count_of_clusters + 2){
+                FAT_TRACE(FAT_TRACE_WARN, "directory " << info.path << " starts at bad cluster " << info.first_cluster);
+                ok = false;
+                return;
+            }
+            // a damaged image can link a directory back to one of its ancestors
+            {
+                std::lock_guard<std::mutex> lock(seen_mutex);
+                if(!seen.insert(info.first_cluster).second){
+                    FAT_TRACE(FAT_TRACE_WARN, "directory " << info.path << " was already walked");
+                    return;
+                }
+            }
+            push(worker, WalkTask{info.path, info.first_cluster});
+        });
+        if(!read_ok){
+            FAT_TRACE(FAT_TRACE_ERROR, "could not read directory " << (task.path.empty() ? "/" : task.path));
+            ok = false;
+        }
+    }
+
+    // NAME.EXT with the padding removed, as fat_open() accepts it
+    static std::string entry_name(const DirEntry &dir) {
+        std::string name((const char *) dir.DIR_Name, 8);
+        name.erase(name.find_last_not_of(' ') + 1);
+        std::string ext((const char *) dir.DIR_Name + 8, 3);
+        ext.erase(ext.find_last_not_of(' ') + 1);
+        return ext.empty() ? name : name + "." + ext;
+    }
+
+    // Decodes a FAT date and time, taken as UTC; 0 when the date is unset
+    static time_t fat_time(uint16_t date, uint16_t time) {
+        if(date == 0){
+            return 0;
+        }
+        struct tm tm = {};
+        tm.tm_year = 80 + (date >> 9);
+        tm.tm_mon = ((date >> 5) & 0xF) - 1;
+        tm.tm_mday = date & 0x1F;
+        tm.tm_hour = time >> 11;
+        tm.tm_min = (time >> 5) & 0x3F;
+        tm.tm_sec = (time & 0x1F) * 2;
+        return timegm(&tm);
+    }
+
+    const FatVolume &vol;
+    const FatWalkCallback &visit;
+    std::vector<Queue> queues;              // one per thread
+    std::atomic<size_t> pending{0};         // directories queued or being listed
+    std::atomic<size_t> queued{0};          // directories sitting in a queue
+    std::mutex idle_mutex;                  // threads with nothing to do wait on idle
+    std::condition_variable idle;
+    std::atomic<bool> ok{true};
+    std::mutex seen_mutex;                  // guards seen
+    std::unordered_set<uint32_t> seen;      // first clusters of the directories queued so far
+};
+
+bool walk_tree(const FatVolume &vol, const std::string &path, const FatWalkCallback &visit, unsigned threads) {
+    if(!is_root_ref(path)){
+        FAT_TRACE(FAT_TRACE_WARN, "trying to read a path that is not indexed from the root: " << path);
+        return false;
+    }
+    DirEntry dir;
+    uint32_t cluster;
+    if(!resolve_path(vol, path, dir, cluster)){
+        return false;
+    }
+    bool is_root = path.find_first_not_of('/') == std::string::npos;
+    if(!is_root && !(dir.DIR_Attr & DirEntryAttributes::DIRECTORY)){
+        FAT_TRACE(FAT_TRACE_INFO, "file " << path << " is not a directory");
+        return false;
+    }
+    if(threads == 0){
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::string prefix = path;
+    prefix.erase(prefix.find_last_not_of('/') + 1);
+    TreeWalk walk(vol, visit, threads);
+    return walk.run(WalkTask{prefix, cluster});
+}
+
+bool fat_volume_walk(FatVolume *vol, const std::string &path, FatWalkCallback visit, unsigned threads) {
+    if(vol == nullptr){
+        FAT_TRACE(FAT_TRACE_WARN, "no file has been mounted");
+        return false;
+    }
+    return walk_tree(*vol, path, visit, threads);
+}
+
+bool fat_walk(const std::string &path, FatWalkCallback visit, unsigned threads) {
+    return fat_volume_walk(mounted_volume, path, std::move(visit), threads);
+}